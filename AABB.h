@@ -20,7 +20,7 @@ public:
          maximum = pmax;
      }
 
-     AABB add(const AABB& other){
+     AABB add(const AABB& other) const {
          glm::vec3 newMin = glm::vec3(fmin(minimum.x, other.minimum.x),
                                       fmin(minimum.y, other.minimum.y),
                                       fmin(minimum.z, other.minimum.z));
@@ -55,8 +55,8 @@ public:
      }
 
      // Optimized implementaion from Andrew Kensler (Pixar)
-     bool intersectFast(const Ray& ray, float tmax){
-        float tmin = 0;
+     bool intersectFast(const Ray& ray, float tmax) const {
+        float tmin = ray.tMin;
         for (int i = 0; i < 3; i++) {
             auto invD = 1.0f / ray.dir[i];
             auto t0 = (minimum[i] - ray.start[i]) * invD;
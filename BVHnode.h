@@ -1,6 +1,8 @@
 #ifndef LIONTEST_BVHNODE_H
 #define LIONTEST_BVHNODE_H
 
+#include <cstdint>
+
 #include "AABB.h"
 #include "Object.h"
 
@@ -25,15 +27,38 @@ bool compareZ(const Object* a, const Object* b) {
 }
 
 
+// Node visit and cache miss counters of one thread. Misses are counted with a simulated
+// direct mapped cache of BVH node addresses (32 KB of 64 byte lines, like an L1 data cache).
+struct TraversalStats {
+    static const int cacheLines = 512;
+    long long nodeVisits = 0;
+    long long cacheMisses = 0;
+    uintptr_t lines[cacheLines] = {};
+
+    void touch(const void* p){
+        uintptr_t line = (uintptr_t)p >> 6;
+        uintptr_t& slot = lines[line % cacheLines];
+        nodeVisits++;
+        if( slot != line ){
+            cacheMisses++;
+            slot = line;
+        }
+    }
+};
+
+// Set per thread to count traversal statistics, null when not measuring.
+thread_local TraversalStats* traversalStats = nullptr;
+
 class BVHnode : public Object{
 public:
     Object* left;
     Object* right;
     AABB box;
+    int axis = 0; // The children are split along it, left has the lower half.
 
     // End is not inclusive.
     void build(std::vector<Object*>& objects, int start, int end){
-        int axis = randomInt(0, 2);
+        axis = randomInt(0, 2);
         auto compar = compareX;
         if( axis == 1 ) compar = compareY;
         else if( axis == 2) compar = compareZ;
@@ -73,6 +98,7 @@ public:
     }
 
     virtual Hit intersect( const Ray& ray, float tMax ){
+        if( traversalStats ) traversalStats->touch(this);
         if(!box.intersectFast(ray, tMax)){
             return Hit();
         }
@@ -85,6 +111,36 @@ public:
         else return rightHit.valid ? rightHit : leftHit;
     }
 
+    bool occluded( const Ray& ray, float tMax ) override {
+        if( traversalStats ) traversalStats->touch(this);
+        if(!box.intersectFast(ray, tMax)) return false;
+        return left->occluded(ray, tMax) || right->occluded(ray, tMax);
+    }
+
+    // The recursion is the node stack shared by the whole packet. Only the rays that hit the box go on.
+    // The nearer child goes first, so its hits shorten tMax and the box test of the other child
+    // can drop the rays that are done.
+    void intersectPacket( RayPacket& packet, PacketMask active ) override {
+        if( packet.frustumCulls(box) ) return;
+        active = packet.hitMask(box, active);
+        if( !active ) return;
+
+        bool flip = packet.negative(active, axis);
+        (flip ? right : left)->intersectPacket(packet, active);
+        if( right != left ) (flip ? left : right)->intersectPacket(packet, active);
+    }
+
+    void occludedPacket( RayPacket& packet, PacketMask active ) override {
+        if( packet.frustumCulls(box) ) return;
+        active = packet.hitMask(box, active);
+        if( !active ) return;
+
+        bool flip = packet.negative(active, axis);
+        (flip ? right : left)->occludedPacket(packet, active);
+        // Rays occluded in the first child have tMax 0 now.
+        if( right != left ) (flip ? left : right)->occludedPacket(packet, active);
+    }
+
     bool getAABB(AABB& aabb) const{
         aabb = box;
         return true;
@@ -16,6 +16,7 @@ public:
     float aperture = 0.0;
     float lensRadius;
     glm::vec3 rightn, upn;
+    float pixelAngle; // Spread of the ray cone through a pixel.
 
     int width, height;
     void init( int pwidth, int pheight ){ width = pwidth; height = pheight; }
@@ -31,6 +32,7 @@ public:
         upn = glm::normalize(up);
 
         lensRadius = aperture / 2;
+        pixelAngle = 2 * tanf(fov / 2) / height;
     }
 
     void set( glm::vec3 peye, glm::vec3 plookat, float pfov ){
@@ -42,14 +44,30 @@ public:
         // Don't generateNewDir random number if there is no need.
         if( aperture < 0.00001){
             glm::vec3 dir = lookat + right * (2.0f * (x) / width - 1) + up*(2.0f *(y) / height - 1 ) - eye;
-            return Ray(eye, dir);
+            Ray ray(eye, dir);
+            ray.coneAngle = pixelAngle;
+            return ray;
         }
 
         glm::vec3 randv = lensRadius * randomUnitDiskVec3();
         glm::vec3 offset = upn * randv.x + rightn * randv.y;
 
         glm::vec3 dir = lookat + right * (2.0f * (x) / width - 1) + up*(2.0f *(y) / height - 1 ) - eye - offset;
-        return Ray(eye + offset, dir);
+        Ray ray(eye + offset, dir);
+        ray.coneAngle = pixelAngle;
+        return ray;
+    }
+
+    // Image coordinates of a point, the inverse of getRay without aperture. False if it is behind the camera.
+    bool project( const glm::vec3& p, float& x, float& y ) const {
+        glm::vec3 forward = lookat - eye;
+        float along = glm::dot(p - eye, forward);
+        if( along <= 0 ) return false;
+        // Onto the plane through lookat, where right and up span the image.
+        glm::vec3 onPlane = (p - eye) * (glm::dot(forward, forward) / along) - forward;
+        x = (glm::dot(onPlane, right) / glm::dot(right, right) + 1) * 0.5f * width;
+        y = (glm::dot(onPlane, up) / glm::dot(up, up) + 1) * 0.5f * height;
+        return true;
     }
 };
 
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+
+#include <glm/glm.hpp>
+#include <glm/ext/scalar_constants.hpp>
+
+#include "RandomVector.h"
+
+// Piecewise constant 1D distribution, for sampling proportionally to a tabulated function.
+struct Distribution1D {
+    std::vector<float> func, cdf;
+    float funcInt = 0;
+
+    void build( const float* f, int n ){
+        func.assign(f, f + n);
+        cdf.assign(n + 1, 0);
+        for( int i = 0; i < n; ++i ) cdf[i + 1] = cdf[i] + func[i] / n;
+        funcInt = cdf[n];
+        // All zero: sample uniformly.
+        for( int i = 1; i <= n; ++i ) cdf[i] = funcInt > 0 ? cdf[i] / funcInt : float(i) / n;
+    }
+
+    int count() const { return func.size(); }
+
+    // Continuous sample in [0, 1), with its pdf and the index of its segment.
+    float sample( float u, float& pdf, int& offset ) const {
+        offset = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin() - 1;
+        offset = glm::clamp(offset, 0, count() - 1);
+        float du = u - cdf[offset];
+        if( cdf[offset + 1] - cdf[offset] > 0 ) du /= cdf[offset + 1] - cdf[offset];
+        pdf = funcInt > 0 ? func[offset] / funcInt : 1;
+        return (offset + du) / count();
+    }
+};
+
+// Piecewise constant 2D distribution: a marginal over the rows, and a conditional for each row.
+struct Distribution2D {
+    std::vector<Distribution1D> conditional;
+    Distribution1D marginal;
+
+    // f has nu values for each of the nv rows.
+    void build( const float* f, int nu, int nv ){
+        conditional.resize(nv);
+        std::vector<float> rowInts(nv);
+        for( int v = 0; v < nv; ++v ) {
+            conditional[v].build(f + v * nu, nu);
+            rowInts[v] = conditional[v].funcInt;
+        }
+        marginal.build(rowInts.data(), nv);
+    }
+
+    glm::vec2 sample( glm::vec2 u, float& pdf ) const {
+        float pdfs[2];
+        int v;
+        float d1 = marginal.sample(u.y, pdfs[1], v);
+        int offset;
+        float d0 = conditional[v].sample(u.x, pdfs[0], offset);
+        pdf = pdfs[0] * pdfs[1];
+        return glm::vec2(d0, d1);
+    }
+
+    float pdf( glm::vec2 p ) const {
+        int iu = glm::clamp(int(p.x * conditional[0].count()), 0, conditional[0].count() - 1);
+        int iv = glm::clamp(int(p.y * marginal.count()), 0, marginal.count() - 1);
+        if( marginal.funcInt == 0 ) return 1;
+        return conditional[iv].func[iu] / marginal.funcInt;
+    }
+};
+
+// HDR equirectangular environment, used as the background and as a light.
+// The top row of the image is straight up (+z), u goes around z starting from -x.
+// Directions are sampled by luminance, with the 2D distribution over the pixels.
+class EnvironmentMap {
+public:
+    int width = 0, height = 0;
+    std::vector<glm::vec3> pixels;
+    Distribution2D distribution;
+    float intensity = 1.0;
+
+    bool loaded() const { return !pixels.empty(); }
+
+    void clear(){ pixels.clear(); width = height = 0; }
+
+    // Radiance .hdr file (RGBE, flat or run length encoded scanlines).
+    bool load( const std::string& path ){
+        clear();
+        std::ifstream fin(path, std::ios::binary);
+        if( !fin || !readHDR(fin) ){
+            std::cout << "Can't load environment: " << path << std::endl;
+            clear();
+            return false;
+        }
+        buildDistribution();
+        return true;
+    }
+
+    glm::vec3 radiance( const glm::vec3& dir ) const {
+        glm::vec2 uv = directionToUV(dir);
+        int x = glm::clamp(int(uv.x * width), 0, width - 1);
+        int y = glm::clamp(int(uv.y * height), 0, height - 1);
+        return pixels[y * width + x] * intensity;
+    }
+
+    glm::vec3 sample( float& pdf ) const {
+        float uvPdf;
+        glm::vec2 uv = distribution.sample(glm::vec2(randomFloat(), randomFloat()), uvPdf);
+        glm::vec3 dir = uvToDirection(uv);
+        float sinTheta = sinf(uv.y * glm::pi<float>());
+        pdf = sinTheta > 0 ? uvPdf / (2 * glm::pi<float>() * glm::pi<float>() * sinTheta) : 0;
+        return dir;
+    }
+
+    // Solid angle pdf of sampling the direction.
+    float pdf( const glm::vec3& dir ) const {
+        glm::vec2 uv = directionToUV(dir);
+        float sinTheta = sinf(uv.y * glm::pi<float>());
+        if( sinTheta <= 0 ) return 0;
+        return distribution.pdf(uv) / (2 * glm::pi<float>() * glm::pi<float>() * sinTheta);
+    }
+
+    static glm::vec2 directionToUV( const glm::vec3& dir ){
+        float theta = acosf(glm::clamp(dir.z, -1.0f, 1.0f));
+        float phi = atan2f(dir.y, dir.x);
+        return glm::vec2(phi / (2 * glm::pi<float>()) + 0.5f, theta / glm::pi<float>());
+    }
+
+    static glm::vec3 uvToDirection( glm::vec2 uv ){
+        float theta = uv.y * glm::pi<float>();
+        float phi = (uv.x - 0.5f) * 2 * glm::pi<float>();
+        return glm::vec3(sinf(theta) * cosf(phi), sinf(theta) * sinf(phi), cosf(theta));
+    }
+
+private:
+    void buildDistribution(){
+        // Weighted by sin(theta), rows near the poles cover less solid angle.
+        std::vector<float> f(width * height);
+        for( int y = 0; y < height; ++y ) {
+            float sinTheta = sinf((y + 0.5f) / height * glm::pi<float>());
+            for( int x = 0; x < width; ++x )
+                f[y * width + x] = luminance(pixels[y * width + x]) * sinTheta;
+        }
+        distribution.build(f.data(), width, height);
+    }
+
+    static glm::vec3 rgbe( const unsigned char* c ){
+        if( c[3] == 0 ) return glm::vec3(0, 0, 0);
+        float f = ldexpf(1.0f, c[3] - (128 + 8));
+        return glm::vec3(c[0] + 0.5f, c[1] + 0.5f, c[2] + 0.5f) * f;
+    }
+
+    bool readHDR( std::ifstream& fin ){
+        std::string line;
+        std::getline(fin, line);
+        if( line.compare(0, 2, "#?") != 0 ) return false;
+        // Header lines until an empty one, then the resolution.
+        while( std::getline(fin, line) && !line.empty() )
+            if( line.compare(0, 7, "FORMAT=") == 0 && line != "FORMAT=32-bit_rle_rgbe" ) return false;
+        std::string ySign, xSign;
+        fin >> ySign >> height >> xSign >> width;
+        fin.get();
+        if( ySign != "-Y" || xSign != "+X" || width <= 0 || height <= 0 ) return false;
+
+        pixels.resize(width * height);
+        std::vector<unsigned char> scanline(width * 4);
+        for( int y = 0; y < height; ++y ) {
+            if( !readScanline(fin, scanline) ) return false;
+            for( int x = 0; x < width; ++x )
+                pixels[y * width + x] = rgbe(&scanline[x * 4]);
+        }
+        return true;
+    }
+
+    bool readScanline( std::ifstream& fin, std::vector<unsigned char>& scanline ){
+        unsigned char start[4];
+        if( !fin.read((char*)start, 4) ) return false;
+        bool rle = width >= 8 && width < 32768 && start[0] == 2 && start[1] == 2 && ((start[2] << 8) | start[3]) == width;
+        if( !rle ){
+            std::copy(start, start + 4, scanline.begin());
+            return (bool)fin.read((char*)&scanline[4], (width - 1) * 4);
+        }
+
+        // Each channel separately, as runs and literal spans.
+        for( int c = 0; c < 4; ++c ) {
+            int x = 0;
+            while( x < width ) {
+                int count = fin.get();
+                if( count == EOF ) return false;
+                if( count > 128 ){
+                    count -= 128;
+                    int value = fin.get();
+                    if( value == EOF || x + count > width ) return false;
+                    for( int i = 0; i < count; ++i ) scanline[(x++) * 4 + c] = value;
+                }else{
+                    if( count == 0 || x + count > width ) return false;
+                    for( int i = 0; i < count; ++i ) scanline[(x++) * 4 + c] = fin.get();
+                }
+            }
+        }
+        return (bool)fin;
+    }
+};
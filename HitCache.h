@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+#include "Camera.h"
+#include "Object.h"
+
+// First hits of camera rays, kept over the samples of a render and over renders while the camera and
+// the geometry stay the same (pinhole camera only). Each pixel has a fixed set of jitter positions and
+// sample i uses position i % jitters, so only the first pass through them traverses the BVH. Later ones
+// intersect just the cached primitive, which gives the same hit with all its data (uv, normal, material).
+class PrimaryHitCache {
+public:
+    int jitters = 8; // Positions per pixel, the antialiasing only uses these.
+
+    // Clears the cache if the camera, image size or scene changed since it was filled.
+    void prepare( const Camera& camera, int width, int height, int sceneVersion ){
+        if( width == cachedWidth && height == cachedHeight && jitters == cachedJitters && sceneVersion == cachedScene &&
+            camera.eye == eye && camera.lookat == lookat && camera.right == right && camera.up == up ) return;
+        eye = camera.eye;
+        lookat = camera.lookat;
+        right = camera.right;
+        up = camera.up;
+        cachedWidth = width;
+        cachedHeight = height;
+        cachedJitters = jitters;
+        cachedScene = sceneVersion;
+        objects.assign((size_t)width * height * jitters, nullptr);
+        filled.assign((size_t)width * height * jitters, 0);
+    }
+
+    void clear(){
+        objects.clear();
+        filled.clear();
+        cachedWidth = cachedHeight = 0;
+    }
+
+    // Offset of jitter position j in the pixel: the R2 sequence, shifted by a hash of the pixel
+    // so neighbours don't share positions.
+    glm::vec2 jitter( int pixel, int j ) const {
+        uint32_t h = (uint32_t)pixel * 0x9E3779B9u;
+        h ^= h >> 16;
+        h *= 0x85EBCA6Bu;
+        h ^= h >> 13;
+        float x = (h & 0xFFFF) / 65536.0f + j * 0.7548777f, y = (h >> 16) / 65536.0f + j * 0.5698403f;
+        return glm::vec2(x - floorf(x), y - floorf(y));
+    }
+
+    // False if position j of the pixel has not been traced yet. object is null for a miss.
+    bool lookup( int pixel, int j, Object*& object ) const {
+        size_t i = (size_t)pixel * cachedJitters + j;
+        if( !filled[i] ) return false;
+        object = objects[i];
+        return true;
+    }
+
+    void store( int pixel, int j, Object* object ){
+        size_t i = (size_t)pixel * cachedJitters + j;
+        objects[i] = object;
+        filled[i] = 1;
+    }
+
+private:
+    std::vector<Object*> objects;
+    std::vector<unsigned char> filled;
+    glm::vec3 eye, lookat, right, up;
+    int cachedWidth = 0, cachedHeight = 0, cachedJitters = 0;
+    int cachedScene = -1;
+};
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <shared_mutex>
+#include <mutex>
+#include <cstdint>
+#include <cmath>
+
+#include <glm/glm.hpp>
+#include <glm/ext/scalar_constants.hpp>
+
+#include "AABB.h"
+#include "RandomVector.h"
+
+// Irradiance cache (Ward): bounced light at diffuse surfaces changes slowly, so it is computed at
+// sparse records and interpolated in between. Records are made lazily where no record is close enough,
+// by gathering a stratified hemisphere of rays, and keep translational and rotational gradients
+// (Ward and Heckbert) so interpolation is smooth. Records are kept in hashed grids of cells doubling in size
+// (like the levels of an octree), each in the level where its area of use overlaps at most 2x2x2 cells.
+// Lookups from many threads share a lock, adding a record takes it alone.
+class IrradianceCache {
+public:
+    struct Record {
+        glm::vec3 position, normal;
+        glm::vec3 irradiance;
+        float radius; // Harmonic mean distance of the gathered hits, clamped.
+        glm::vec3 translation[3], rotation[3]; // Gradients of each color channel.
+    };
+
+    float accuracy = 0.3; // Largest error a record is used with, smaller makes more records.
+    int thetaStrata = 8;
+    int phiStrata = 24;
+    float minSpacing = 3, maxSpacing = 100; // Record radius limits, in ray cone widths (about pixels).
+
+    void init( const AABB& box ){
+        clear();
+        baseCellSize = glm::length(box.maximum - box.minimum) / 4096;
+        if( !(baseCellSize > 0) ) baseCellSize = 1;
+    }
+
+    void clear(){
+        std::unique_lock<std::shared_timed_mutex> lock(mutex);
+        records.clear();
+        cells.clear();
+        usedLevels = 0;
+    }
+
+    size_t size(){
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        return records.size();
+    }
+
+    // Weighted average of the records usable at the point, false if there are none.
+    bool lookup( const glm::vec3& p, const glm::vec3& n, glm::vec3& irradiance ){
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        glm::vec3 sum(0, 0, 0);
+        float weightSum = 0;
+        for( int level = 0; level < levels; ++level ) {
+            if( !(usedLevels & 1u << level) ) continue;
+            auto cell = cells.find(cellKey(level, cellOf(level, p)));
+            if( cell == cells.end() ) continue;
+            for( int i : cell->second ) {
+                const Record& record = records[i];
+                glm::vec3 d = p - record.position;
+                // Not records in front of the point, they see different light.
+                if( glm::dot(d, n + record.normal) < -0.1f * record.radius ) continue;
+                float error = glm::length(d) / record.radius + sqrtf(fmax(0.0f, 1 - glm::dot(n, record.normal)));
+                if( error >= accuracy ) continue;
+                // Goes to zero at the border, so records don't pop in.
+                float weight = 1 / fmax(error, 1e-4f) - 1 / accuracy;
+
+                glm::vec3 axis = glm::cross(record.normal, n);
+                glm::vec3 value;
+                for( int c = 0; c < 3; ++c )
+                    value[c] = record.irradiance[c] + glm::dot(record.translation[c], d) + glm::dot(record.rotation[c], axis);
+                sum += weight * glm::max(value, glm::vec3(0, 0, 0));
+                weightSum += weight;
+            }
+        }
+        if( weightSum <= 0 ) return false;
+        irradiance = sum / weightSum;
+        return true;
+    }
+
+    // Gathers a new record. gather(direction, distance) returns the radiance coming from the direction
+    // and the distance to where it comes from (infinity for none).
+    // coneWidth is the pixel footprint at the point, for the radius limits.
+    template<typename F>
+    Record compute( const glm::vec3& p, const glm::vec3& n, float coneWidth, F gather ){
+        int M = thetaStrata, N = phiStrata;
+        std::vector<glm::vec3> L(M * N);
+        std::vector<float> r(M * N);
+
+        Record record;
+        record.position = p;
+        record.normal = n;
+        record.irradiance = glm::vec3(0, 0, 0);
+        for( int c = 0; c < 3; ++c ) record.translation[c] = record.rotation[c] = glm::vec3(0, 0, 0);
+
+        // Cosine weighted strata: sin^2 theta and phi uniform.
+        ONB onb(n);
+        float inverseDistances = 0;
+        for( int j = 0; j < M; ++j )
+            for( int k = 0; k < N; ++k ) {
+                float sin2 = (j + randomFloat()) / M;
+                float phi = 2 * glm::pi<float>() * (k + randomFloat()) / N;
+                float sinTheta = sqrtf(sin2), cosTheta = sqrtf(1 - sin2);
+                glm::vec3 dir = onb.get(glm::vec3(cosf(phi) * sinTheta, sinf(phi) * sinTheta, cosTheta));
+
+                float dist = infinity;
+                glm::vec3 radiance = gather(dir, dist);
+                L[j * N + k] = radiance;
+                r[j * N + k] = dist;
+                record.irradiance += radiance;
+                inverseDistances += 1 / dist;
+
+                // Rotating the normal towards phi + pi/2 changes the cosine weight by -tan theta.
+                glm::vec3 v = onb.get(glm::vec3(-sinf(phi), cosf(phi), 0));
+                for( int c = 0; c < 3; ++c ) record.rotation[c] += v * (-sinTheta / fmax(cosTheta, 1e-3f) * radiance[c]);
+            }
+        float norm = glm::pi<float>() / (M * N);
+        record.irradiance *= norm;
+        for( int c = 0; c < 3; ++c ) record.rotation[c] *= norm;
+
+        // Translation: how the solid angles of the strata change when the point moves, at the borders between them.
+        for( int k = 0; k < N; ++k ) {
+            float phiCenter = 2 * glm::pi<float>() * (k + 0.5f) / N;
+            float phiBorder = 2 * glm::pi<float>() * k / N;
+            glm::vec3 u = onb.get(glm::vec3(cosf(phiCenter), sinf(phiCenter), 0));
+            glm::vec3 v = onb.get(glm::vec3(-sinf(phiBorder), cosf(phiBorder), 0));
+            int previous = (k + N - 1) % N;
+            for( int j = 0; j < M; ++j ) {
+                if( j > 0 ){
+                    float sin2 = float(j) / M; // At the border to the stratum below.
+                    float weight = 2 * glm::pi<float>() / N * sqrtf(sin2) * (1 - sin2) / fmin(r[j * N + k], r[(j - 1) * N + k]);
+                    glm::vec3 diff = L[j * N + k] - L[(j - 1) * N + k];
+                    for( int c = 0; c < 3; ++c ) record.translation[c] += u * (weight * diff[c]);
+                }
+                float weight = (sqrtf(float(j + 1) / M) - sqrtf(float(j) / M)) / fmin(r[j * N + k], r[j * N + previous]);
+                glm::vec3 diff = L[j * N + k] - L[j * N + previous];
+                for( int c = 0; c < 3; ++c ) record.translation[c] += v * (weight * diff[c]);
+            }
+        }
+
+        record.radius = inverseDistances > 0 ? M * N / inverseDistances : infinity;
+        record.radius = glm::clamp(record.radius, minSpacing * coneWidth, maxSpacing * coneWidth);
+        record.radius = fmax(record.radius, 1e-5f);
+
+        // The gradients must not make the irradiance negative within the record.
+        for( int c = 0; c < 3; ++c ) {
+            float change = glm::length(record.translation[c]) * record.radius * accuracy;
+            if( change > record.irradiance[c] ) record.translation[c] *= record.irradiance[c] / change;
+        }
+        return record;
+    }
+
+    void add( const Record& record ){
+        float reach = record.radius * accuracy;
+        int level = 0;
+        while( level < levels - 1 && cellSize(level) < 2 * reach ) level++;
+        glm::ivec3 lo = cellOf(level, record.position - glm::vec3(reach)), hi = cellOf(level, record.position + glm::vec3(reach));
+
+        std::unique_lock<std::shared_timed_mutex> lock(mutex);
+        int index = records.size();
+        records.push_back(record);
+        usedLevels |= 1u << level;
+        for( int z = lo.z; z <= hi.z; ++z )
+            for( int y = lo.y; y <= hi.y; ++y )
+                for( int x = lo.x; x <= hi.x; ++x )
+                    cells[cellKey(level, glm::ivec3(x, y, z))].push_back(index);
+    }
+
+private:
+    std::vector<Record> records;
+    std::unordered_map<uint64_t, std::vector<int>> cells;
+    std::shared_timed_mutex mutex;
+    static const int levels = 16;
+    unsigned usedLevels = 0; // Bit mask of the levels with records.
+    float baseCellSize = 1;
+
+    float cellSize( int level ) const { return baseCellSize * float(1 << level); }
+
+    glm::ivec3 cellOf( int level, const glm::vec3& p ) const {
+        glm::vec3 f = p / cellSize(level);
+        return glm::ivec3((int)floorf(f.x), (int)floorf(f.y), (int)floorf(f.z));
+    }
+
+    static uint64_t cellKey( int level, glm::ivec3 c ){
+        return (uint64_t)level << 60 | (uint64_t)(c.x & 0xFFFFF) << 40 | (uint64_t)(c.y & 0xFFFFF) << 20 | (uint64_t)(c.z & 0xFFFFF);
+    }
+};
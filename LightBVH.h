@@ -0,0 +1,282 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include "AABB.h"
+#include "Object.h"
+
+// Cone of directions, used to bound the orientation of emitters.
+// cosTheta = -1 means the whole sphere.
+struct DirectionCone {
+    glm::vec3 axis = glm::vec3(0, 0, 1);
+    float cosTheta = -1;
+
+    bool entireSphere() const { return cosTheta <= -0.9999f; }
+
+    // Smallest cone containing both cones.
+    static DirectionCone unite(const DirectionCone& a, const DirectionCone& b){
+        if( a.entireSphere() || b.entireSphere() ) return DirectionCone();
+
+        float thetaA = std::acos(glm::clamp(a.cosTheta, -1.0f, 1.0f));
+        float thetaB = std::acos(glm::clamp(b.cosTheta, -1.0f, 1.0f));
+        float thetaD = std::acos(glm::clamp(glm::dot(a.axis, b.axis), -1.0f, 1.0f));
+        float pi = glm::pi<float>();
+
+        // One cone already contains the other.
+        if( fmin(thetaD + thetaB, pi) <= thetaA ) return a;
+        if( fmin(thetaD + thetaA, pi) <= thetaB ) return b;
+
+        float thetaO = (thetaA + thetaD + thetaB) / 2;
+        if( thetaO >= pi ) return DirectionCone();
+
+        // Rotate the axis of a towards b (Rodrigues).
+        glm::vec3 k = glm::cross(a.axis, b.axis);
+        if( length2(k) < 1e-12f ) return DirectionCone();
+        k = glm::normalize(k);
+        float thetaR = thetaO - thetaA;
+        glm::vec3 axis = a.axis * cosf(thetaR) + glm::cross(k, a.axis) * sinf(thetaR)
+                         + k * glm::dot(k, a.axis) * (1 - cosf(thetaR));
+
+        DirectionCone cone;
+        cone.axis = glm::normalize(axis);
+        cone.cosTheta = cosf(thetaO);
+        return cone;
+    }
+};
+
+// Spatial, power and orientation bounds of one or more emitters.
+struct LightBounds {
+    AABB box;
+    float power = 0;
+    DirectionCone cone;
+    // Emitters are lambertian, they emit up to 90 degrees from the normal.
+    float cosThetaE = 0;
+
+    static LightBounds unite(const LightBounds& a, const LightBounds& b){
+        if( a.power == 0 ) return b;
+        if( b.power == 0 ) return a;
+        LightBounds bounds;
+        bounds.box = a.box.add(b.box);
+        bounds.power = a.power + b.power;
+        bounds.cone = DirectionCone::unite(a.cone, b.cone);
+        bounds.cosThetaE = fmin(a.cosThetaE, b.cosThetaE);
+        return bounds;
+    }
+
+    glm::vec3 centroid() const { return (box.minimum + box.maximum) * 0.5f; }
+
+    // cos(max(0, a - b)) from the sines and cosines of the angles.
+    static float cosSubClamped(float sinA, float cosA, float sinB, float cosB){
+        if( cosA > cosB ) return 1;
+        return cosA * cosB + sinA * sinB;
+    }
+    static float sinSubClamped(float sinA, float cosA, float sinB, float cosB){
+        if( cosA > cosB ) return 0;
+        return sinA * cosB - cosA * sinB;
+    }
+
+    // Estimate of how much light these emitters give to point p with normal n (Estevez and Kulla).
+    float importance(const glm::vec3& p, const glm::vec3& n) const {
+        glm::vec3 center = centroid();
+        float d2 = length2(p - center);
+        float halfDiagonal = glm::length(box.maximum - box.minimum) / 2;
+        d2 = fmax(d2, halfDiagonal);
+        if( d2 <= 0 ) return power;
+
+        glm::vec3 wi = glm::normalize(p - center);
+        float cosThetaW = glm::dot(cone.axis, wi);
+        float sinThetaW = sqrtf(fmax(0.0f, 1 - cosThetaW * cosThetaW));
+        float cosThetaO = cone.cosTheta;
+        float sinThetaO = sqrtf(fmax(0.0f, 1 - cosThetaO * cosThetaO));
+
+        // Angle subtended by the bounding box, seen from p.
+        float cosThetaB = -1;
+        float radius2 = halfDiagonal * halfDiagonal;
+        float dist2 = length2(p - center);
+        bool inside = p.x >= box.minimum.x && p.y >= box.minimum.y && p.z >= box.minimum.z &&
+                      p.x <= box.maximum.x && p.y <= box.maximum.y && p.z <= box.maximum.z;
+        if( !inside && dist2 > radius2 )
+            cosThetaB = sqrtf(fmax(0.0f, 1 - radius2 / dist2));
+        float sinThetaB = sqrtf(fmax(0.0f, 1 - cosThetaB * cosThetaB));
+
+        // Minimum angle between the emission cone and the direction to p.
+        float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+        float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+        float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+        if( cosThetaP <= cosThetaE ) return 0;
+
+        float result = power * cosThetaP / d2;
+
+        // Minimum angle to the surface normal at p.
+        float cosThetaI = glm::abs(glm::dot(wi, n));
+        float sinThetaI = sqrtf(fmax(0.0f, 1 - cosThetaI * cosThetaI));
+        result *= cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+
+        return fmax(result, 0.0f);
+    }
+};
+
+
+// Bounding volume hierarchy over the emitters, for choosing lights by importance.
+// Choosing a light and evaluating its probability are both O(log N).
+class LightBVH {
+public:
+    struct Node {
+        LightBounds bounds;
+        int child = -1; // Index of second child (first is node + 1), or light index for leaves.
+        bool leaf = false;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<Object*> lights;
+    // Indices of lights are the indices in the list given to build (emitters without power are skipped).
+    // Path from root to the leaf of every light, one bit per level (1 = second child).
+    std::vector<uint64_t> lightBits;
+
+    void build(const std::vector<Object*>& emitters){
+        nodes.clear();
+        lights.clear();
+        lightBits.clear();
+
+        std::vector<std::pair<int, LightBounds>> bounds;
+        for( Object* emitter : emitters ) {
+            LightBounds lb = getBounds(emitter);
+            if( lb.power <= 0 ) continue;
+            bounds.push_back({(int)lights.size(), lb});
+            lights.push_back(emitter);
+        }
+        lightBits.resize(lights.size());
+        if( !bounds.empty() )
+            buildNode(bounds, 0, bounds.size(), 0, 0);
+    }
+
+    bool empty() const { return nodes.empty(); }
+
+    // Choose a light for shading point p with normal n. Returns -1 if no light contributes.
+    int sample(const glm::vec3& p, const glm::vec3& n, float u, float& pmf) const {
+        if( nodes.empty() ) return -1;
+        pmf = 1;
+        int nodeIndex = 0;
+        if( nodes[0].bounds.importance(p, n) <= 0 ) return -1;
+
+        while( !nodes[nodeIndex].leaf ){
+            const Node& node = nodes[nodeIndex];
+            float ci0 = nodes[nodeIndex + 1].bounds.importance(p, n);
+            float ci1 = nodes[node.child].bounds.importance(p, n);
+            if( ci0 == 0 && ci1 == 0 ) return -1;
+
+            float p0 = ci0 / (ci0 + ci1);
+            if( u < p0 ){
+                nodeIndex = nodeIndex + 1;
+                u = fmin(u / p0, 0.99999994f);
+                pmf *= p0;
+            }else{
+                nodeIndex = node.child;
+                u = fmin((u - p0) / (1 - p0), 0.99999994f);
+                pmf *= 1 - p0;
+            }
+        }
+        return nodes[nodeIndex].child;
+    }
+
+    // Probability of choosing light i from point p with normal n, walking down its path.
+    float pmf(const glm::vec3& p, const glm::vec3& n, int i) const {
+        uint64_t bits = lightBits[i];
+        int nodeIndex = 0;
+        float prob = 1;
+        if( nodes[0].bounds.importance(p, n) <= 0 ) return 0;
+
+        while( !nodes[nodeIndex].leaf ){
+            const Node& node = nodes[nodeIndex];
+            float ci0 = nodes[nodeIndex + 1].bounds.importance(p, n);
+            float ci1 = nodes[node.child].bounds.importance(p, n);
+            if( ci0 == 0 && ci1 == 0 ) return 0;
+
+            if( bits & 1 ){
+                prob *= ci1 / (ci0 + ci1);
+                nodeIndex = node.child;
+            }else{
+                prob *= ci0 / (ci0 + ci1);
+                nodeIndex = nodeIndex + 1;
+            }
+            bits >>= 1;
+        }
+        return prob;
+    }
+
+    // Sum of pmf * solid angle pdf over the lights the direction can reach.
+    float pdf(const glm::vec3& p, const glm::vec3& n, const glm::vec3& dir) const {
+        return pdf(p, dir, [&](int i){ return pmf(p, n, i); });
+    }
+
+    // Same, but with the lights chosen by a different distribution, using the tree only to find the lights hit.
+    template<typename PMF>
+    float pdf(const glm::vec3& p, const glm::vec3& dir, PMF lightPmf) const {
+        if( nodes.empty() ) return 0;
+        Ray ray(p, dir);
+        float sum = 0;
+        pdfNode(0, ray, p, lightPmf, sum);
+        return sum;
+    }
+
+private:
+    static LightBounds getBounds(Object* emitter){
+        LightBounds lb;
+        emitter->getAABB(lb.box);
+        lb.power = emitter->power();
+        emitter->normalCone(lb.cone.axis, lb.cone.cosTheta);
+        return lb;
+    }
+
+    template<typename PMF>
+    void pdfNode(int nodeIndex, const Ray& ray, const glm::vec3& p, PMF& lightPmf, float& sum) const {
+        const Node& node = nodes[nodeIndex];
+        if( !node.bounds.box.intersectFast(ray, infinity) ) return;
+        if( node.leaf ){
+            float lightPdf = lights[node.child]->pdf(p, ray.dir);
+            if( lightPdf > 0 ) sum += lightPmf(node.child) * lightPdf;
+            return;
+        }
+        pdfNode(nodeIndex + 1, ray, p, lightPmf, sum);
+        pdfNode(node.child, ray, p, lightPmf, sum);
+    }
+
+    // End is not inclusive.
+    int buildNode(std::vector<std::pair<int, LightBounds>>& bounds, int start, int end, uint64_t bits, int depth){
+        int nodeIndex = nodes.size();
+        nodes.push_back(Node());
+
+        if( end - start == 1 ){
+            nodes[nodeIndex].bounds = bounds[start].second;
+            nodes[nodeIndex].child = bounds[start].first;
+            nodes[nodeIndex].leaf = true;
+            lightBits[bounds[start].first] = bits;
+            return nodeIndex;
+        }
+
+        // Split at the median along the longest axis of the centroids.
+        AABB centroids;
+        for( int i = start; i < end; ++i ) {
+            glm::vec3 c = bounds[i].second.centroid();
+            centroids = centroids.add(AABB(c, c));
+        }
+        glm::vec3 extent = centroids.maximum - centroids.minimum;
+        int axis = 0;
+        if( extent.y > extent.x ) axis = 1;
+        if( extent.z > extent[axis] ) axis = 2;
+
+        int mid = (start + end) / 2;
+        std::nth_element(bounds.begin() + start, bounds.begin() + mid, bounds.begin() + end,
+                         [axis](const std::pair<int, LightBounds>& a, const std::pair<int, LightBounds>& b){
+                             return a.second.centroid()[axis] < b.second.centroid()[axis];
+                         });
+
+        buildNode(bounds, start, mid, bits, depth + 1);
+        int second = buildNode(bounds, mid, end, bits | (uint64_t(1) << depth), depth + 1);
+
+        nodes[nodeIndex].child = second;
+        nodes[nodeIndex].bounds = LightBounds::unite(nodes[nodeIndex + 1].bounds, nodes[second].bounds);
+        return nodeIndex;
+    }
+};
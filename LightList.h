@@ -0,0 +1,101 @@
+#pragma once
+
+#include <vector>
+
+#include "Object.h"
+
+// Walker's alias method, draws an index proportional to its weight in O(1).
+class AliasTable {
+public:
+    std::vector<float> prob;
+    std::vector<int> alias;
+    std::vector<float> pmfs;
+
+    // Vose's construction.
+    void build(const std::vector<float>& weights){
+        int n = weights.size();
+        prob.assign(n, 0);
+        alias.assign(n, 0);
+        pmfs.assign(n, 0);
+
+        double sum = 0;
+        for( float w : weights ) sum += w;
+        if( sum <= 0 ){ prob.clear(); alias.clear(); pmfs.clear(); return; }
+
+        std::vector<double> scaled(n);
+        std::vector<int> small, large;
+        for( int i = 0; i < n; ++i ) {
+            pmfs[i] = weights[i] / sum;
+            scaled[i] = weights[i] / sum * n;
+            if( scaled[i] < 1 ) small.push_back(i);
+            else large.push_back(i);
+        }
+
+        while( !small.empty() && !large.empty() ){
+            int s = small.back(); small.pop_back();
+            int l = large.back(); large.pop_back();
+            prob[s] = scaled[s];
+            alias[s] = l;
+            scaled[l] = scaled[l] + scaled[s] - 1;
+            if( scaled[l] < 1 ) small.push_back(l);
+            else large.push_back(l);
+        }
+        // Left over because of rounding, these are (almost) exactly 1.
+        for( int l : large ) prob[l] = 1;
+        for( int s : small ) prob[s] = 1;
+    }
+
+    bool empty() const { return prob.empty(); }
+
+    int sample(float u, float& pmf) const {
+        int n = prob.size();
+        float scaled = u * n;
+        int i = std::min( (int)scaled, n - 1 );
+        float up = scaled - i;
+        if( up >= prob[i] ) i = alias[i];
+        pmf = pmfs[i];
+        return i;
+    }
+
+    float pmf(int i) const { return empty() ? 0 : pmfs[i]; }
+};
+
+
+// Every light in the scene, point lights and emissive objects, weighted by emitted power.
+class LightList {
+public:
+    struct Entry {
+        bool point; // Point light or emissive object.
+        int index;  // Index into Trace::lights or emitters.
+        float power;
+    };
+
+    std::vector<Entry> entries;
+    // Emissive objects that give light, in the order of emitterTable.
+    std::vector<Object*> emitters;
+
+    AliasTable pointTable;
+    AliasTable emitterTable;
+
+    void build(const std::vector<Light>& lights, const std::vector<Object*>& emissiveList){
+        entries.clear();
+        emitters.clear();
+
+        std::vector<float> pointWeights, emitterWeights;
+        for( int i = 0; i < lights.size(); ++i ) {
+            float power = luminance(lights[i].power);
+            entries.push_back({true, i, power});
+            pointWeights.push_back(power);
+        }
+        for( Object* emitter : emissiveList ) {
+            float power = emitter->power();
+            if( power <= 0 ) continue;
+            entries.push_back({false, (int)emitters.size(), power});
+            emitters.push_back(emitter);
+            emitterWeights.push_back(power);
+        }
+
+        pointTable.build(pointWeights);
+        emitterTable.build(emitterWeights);
+    }
+};
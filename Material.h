@@ -1,83 +1,93 @@
 #pragma once
 
+#include <vector>
+#include <string>
+#include <cstdint>
+
 #include "RandomVector.h"
 #include "Ray.h"
+#include "TextureCache.h"
 
 const float eps = 0.0001f;
 
-class Material {
-public:
+enum MaterialType : uint8_t { DIFFUSE, MIRROR, TRANSPARENT, EMISSIVE };
+
+// Plain material parameters, tagged with the type. Stored in the material table and referenced
+// by index from objects and hits, evaluated with a switch instead of virtual calls.
+struct Material {
+    MaterialType type = DIFFUSE;
     glm::vec3 albedo;
 
     // For direct lightning, without path tracing.
     glm::vec3 ambient, specular;
     float shininess;
 
-    Material( glm::vec3 pdiffuse, glm::vec3 pspecular, float pshininess ){
+    float fuzzy = 0.0; // Mirror.
+    float refIndex = 1.0; // Transparent.
+    int albedoTexture = -1; // Index in the texture cache, multiplies albedo.
+
+    Material() = default;
+
+    Material( MaterialType ptype, glm::vec3 pdiffuse, glm::vec3 pspecular = glm::vec3( 0.9, 0.9, 0.9 ), float pshininess = 10 ){
+        type = ptype;
         ambient = pdiffuse * glm::pi<float>();
         albedo = pdiffuse;
         specular = pspecular;
         shininess = pshininess;
     }
 
-    virtual Ray scatter( const Ray& ray, const Hit& hit, glm::vec3& attenuation, float& pdf) = 0;
-
-    virtual bool diffuse(){ return false; }
-    virtual bool emissive(){ return false; }
-    virtual glm::vec3 emit(const Hit& hit){return glm::vec3(0,0,0);}
-    virtual float pdf(const Ray& ray, const Hit& hit, const Ray& outRay ){ return 1;}
-    virtual bool noPdf(){ return true; }
-    virtual bool transparent(){return false;}
-};
-
-class DiffuseMaterial : public Material {
-public:
-    DiffuseMaterial( glm::vec3 pdiffuse ) : Material(pdiffuse, glm::vec3( 0.9, 0.9, 0.9 ), 10){}
+    bool diffuse() const { return type == DIFFUSE; }
+    bool emissive() const { return type == EMISSIVE; }
+    bool transparent() const { return type == TRANSPARENT; }
+    // Reflective and refractive materials, their pdf is 1.
+    bool noPdf() const { return type != DIFFUSE; }
 
-    Ray scatter( const Ray& ray, const Hit& hit, glm::vec3& attenuation, float& pdf) override {
-        attenuation = albedo;
-        return Ray(glm::vec3(0,0,0), glm::vec3(0,0,0)); // Placeholder data.
+    bool sameAs(const Material& other) const {
+        return type == other.type && albedo == other.albedo && ambient == other.ambient && specular == other.specular &&
+               shininess == other.shininess && fuzzy == other.fuzzy && refIndex == other.refIndex && albedoTexture == other.albedoTexture;
     }
 
-    bool diffuse() override{return true;}
-
-    float pdf(const Ray &ray, const Hit &hit, const Ray &outRay) override {
-        float cos = dot( hit.normal, outRay.dir); // Ray.dir is normalized from the start.
-        if( cos < 0) return 0;
-        return cos / glm::pi<float>(); //  cos(Θ)/π
+    // Texture color at the hit, white without a texture.
+    glm::vec3 textureAt(const Hit& hit) const {
+        if( albedoTexture < 0 ) return glm::vec3(1, 1, 1);
+        return textureCache.sample(albedoTexture, hit.uv, hit.footprint);
     }
 
-    bool noPdf() override{ return false; }
-};
-
+    glm::vec3 albedoAt(const Hit& hit) const { return albedo * textureAt(hit); }
 
-class MirrorMaterial : public Material{
-public:
-    float fuzzy = 0.0;
-    MirrorMaterial( glm::vec3 pdiffuse, float pfuzzy = 0.0 ) : Material(pdiffuse, glm::vec3( 0.9, 0.9, 0.9 ), 10){
-        fuzzy = pfuzzy;
+    glm::vec3 emit(const Hit& hit) const {
+        if( type != EMISSIVE || !hit.frontFace ) return glm::vec3(0,0,0);
+        return albedo;
     }
 
-    Ray scatter( const Ray& ray, const Hit& hit, glm::vec3& attenuation, float& pdf) override {
-        attenuation = albedo;
-        auto newRayDir = glm::reflect(ray.dir, hit.normal);
-        newRayDir += fuzzy * randomInSphereVec3();
-        if( glm::dot( newRayDir, hit.normal) < 0 ) attenuation.x = -1;
-        return {hit.position + hit.normal * eps, newRayDir};
+    float pdf(const Ray& ray, const Hit& hit, const Ray& outRay ) const {
+        if( type != DIFFUSE ) return 1;
+        float cos = dot( hit.normal, outRay.dir); // Ray.dir is normalized from the start.
+        if( cos < 0) return 0;
+        return cos / glm::pi<float>(); //  cos(Θ)/π
     }
-};
-
-class TransparentMaterial : public Material {
-public:
-    float refIndex;
 
-    TransparentMaterial( float pratio ) : Material(glm::vec3( 0.9, 0.9, 0.9 ), glm::vec3( 0.9, 0.9, 0.9 ), 10){
-        refIndex = pratio;
+    Ray scatter( const Ray& ray, const Hit& hit, glm::vec3& attenuation, float& pdf) const {
+        switch( type ) {
+            case MIRROR: {
+                attenuation = albedoAt(hit);
+                auto newRayDir = glm::reflect(ray.dir, hit.normal);
+                newRayDir += fuzzy * randomInSphereVec3();
+                if( glm::dot( newRayDir, hit.normal) < 0 ) attenuation.x = -1;
+                return {hit.position + hit.normal * eps, newRayDir};
+            }
+            case TRANSPARENT:
+                return refract(ray, hit, attenuation);
+            case EMISSIVE:
+                attenuation = albedo;
+                return Ray(glm::vec3(0,0,0), glm::vec3(1, 1, 1));
+            default:
+                attenuation = albedoAt(hit);
+                return Ray(glm::vec3(0,0,0), glm::vec3(0,0,0)); // Placeholder data, the direction is sampled by the tracer.
+        }
     }
 
-    virtual bool transparent(){return true;}
-
-    Ray scatter( const Ray& ray, const Hit& hit, glm::vec3& attenuation, float& pdf) override {
+    Ray refract( const Ray& ray, const Hit& hit, glm::vec3& attenuation ) const {
         attenuation = glm::vec3(1.0, 1.0, 1.0);
 
         float refRatio = refIndex;
@@ -95,32 +105,71 @@ public:
             newRayDir = glm::reflect(ray.dir, hit.normal);
             adjEps = eps;
         }
-        else
+        else {
             newRayDir = glm::refract(ray.dir, hit.normal, refRatio);
+            // Rounding can still make it total internal reflection, refract returns zero then.
+            if( length2(newRayDir) == 0 ){
+                newRayDir = glm::reflect(ray.dir, hit.normal);
+                adjEps = eps;
+            }
+        }
 
         return Ray(hit.position + hit.normal * adjEps, newRayDir);
     }
 
     // Schlick's approximation.
-    float Schlick( float cost, float refRatio ){
+    static float Schlick( float cost, float refRatio ){
         float r0 = (1-refRatio) / (1+refRatio);
         r0 = r0*r0;
         return r0 + (1-r0) * pow(1-cost, 5);
     }
 };
 
-class EmissiveMaterial : public Material {
+inline Material DiffuseMaterial( glm::vec3 pdiffuse ){ return Material(DIFFUSE, pdiffuse); }
+
+// Diffuse material with an image texture.
+inline Material TexturedMaterial( const std::string& path, glm::vec3 ptint = glm::vec3(1, 1, 1) ){
+    Material material(DIFFUSE, ptint);
+    material.albedoTexture = textureCache.add(path);
+    return material;
+}
+
+inline Material MirrorMaterial( glm::vec3 pdiffuse, float pfuzzy = 0.0 ){
+    Material material(MIRROR, pdiffuse);
+    material.fuzzy = pfuzzy;
+    return material;
+}
+
+inline Material TransparentMaterial( float pratio ){
+    Material material(TRANSPARENT, glm::vec3( 0.9, 0.9, 0.9 ));
+    material.refIndex = pratio;
+    return material;
+}
+
+inline Material EmissiveMaterial( glm::vec3 pdiffuse ){ return Material(EMISSIVE, pdiffuse); }
+
+// All materials of the program, objects refer to them by index.
+struct MaterialTable {
+    std::vector<Material> materials;
+    std::vector<std::string> names;
+
+    // Adds the material, or replaces the one with the same name. Returns its index.
+    MaterialId add( const std::string& name, const Material& material ){
+        for( int i = 0; i < names.size(); ++i ) {
+            if( names[i] == name ){
+                materials[i] = material;
+                return i;
+            }
+        }
+        materials.push_back(material);
+        names.push_back(name);
+        return materials.size() - 1;
+    }
 
-public:
-    EmissiveMaterial( glm::vec3 pdiffuse ) : Material(pdiffuse, glm::vec3( 0.9, 0.9, 0.9 ), 10){}
+    int size() const { return materials.size(); }
 
-    bool emissive(){ return true; }
-    glm::vec3 emit(const Hit &hit) override{
-        if( !hit.frontFace ) return glm::vec3(0,0,0);
-        else return albedo;
-    }
-    Ray scatter( const Ray& ray, const Hit& hit, glm::vec3& attenuation, float& pdf) override {
-        attenuation = albedo;
-        return Ray(glm::vec3(0,0,0), glm::vec3(1, 1, 1));
-    }
-};
\ No newline at end of file
+    Material& operator[]( MaterialId id ){ return materials[id]; }
+    const Material& operator[]( MaterialId id ) const { return materials[id]; }
+};
+
+MaterialTable materialTable;
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "Object.h"
+#include "BVHnode.h"
+#include "LightBVH.h"
+
+// Triangles of an emissive mesh, grouped so they can be sampled as one area light.
+// The triangles themselves stay in the scene for intersection, this is only used for sampling.
+class MeshLight : public Object {
+public:
+    std::vector<Object*> triangles;
+    std::vector<float> cdf; // Cumulative triangle areas, for choosing a triangle by area.
+    float totalArea = 0;
+    BVHnode bvh; // For finding the triangles a direction hits.
+    AABB box;
+    DirectionCone cone;
+
+    MeshLight(const std::vector<Triangle*>& ptriangles){
+        material = ptriangles[0]->material;
+
+        for( Triangle* tri : ptriangles ) {
+            triangles.push_back(tri);
+            totalArea += tri->area();
+            cdf.push_back(totalArea);
+
+            AABB triBox;
+            tri->getAABB(triBox);
+            box = box.add(triBox);
+
+            DirectionCone triCone;
+            tri->normalCone(triCone.axis, triCone.cosTheta);
+            cone = triangles.size() == 1 ? triCone : DirectionCone::unite(cone, triCone);
+        }
+
+        // Build works on a copy, it reorders the list.
+        std::vector<Object*> sorted = triangles;
+        bvh.build(sorted, 0, sorted.size());
+    }
+
+    ~MeshLight(){ bvh.destroy(); }
+
+    Hit intersect( const Ray& ray, float tMax ){ return bvh.intersect(ray, tMax); }
+
+    bool getAABB(AABB& aabb) const {
+        aabb = box;
+        return true;
+    }
+
+    float area() const override { return totalArea; }
+
+    void normalCone(glm::vec3& axis, float& cosTheta) const override { axis = cone.axis; cosTheta = cone.cosTheta; }
+
+    // Area sampling: a triangle by area from the cdf, then a uniform point on it.
+    glm::vec3 randomPoint() override{
+        glm::vec3 normal;
+        return emissionPoint(normal);
+    }
+
+    glm::vec3 emissionPoint(glm::vec3& normal) override{
+        float u = randomFloat() * totalArea;
+        int i = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+        if( i >= triangles.size() ) i = triangles.size() - 1;
+        normal = static_cast<Triangle*>(triangles[i])->n;
+        return triangles[i]->randomPoint();
+    }
+
+    // Solid angle pdf: every point of the mesh along the direction could have been sampled.
+    float pdf(glm::vec3 origin, const glm::vec3 &newRayDir) override{
+        float sum = 0;
+        // Walk through the mesh along the direction until the ray leaves it. The ray stays the same, tMin
+        // moves past each hit, so no layer is stepped over however thin it is.
+        Ray ray(origin, newRayDir);
+        while( true ) {
+            Hit hit = bvh.intersect(ray, infinity);
+            if( !hit.valid ) break;
+
+            // Geometric normal, the area measure does not care about smooth shading.
+            float cosAlpha = glm::abs( glm::dot(ray.dir, static_cast<Triangle*>(hit.object)->n) );
+            if( cosAlpha > 0 ) sum += hit.t * hit.t / (cosAlpha * totalArea);
+
+            ray.tMin = hit.t;
+        }
+        return sum;
+    }
+};
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <vector>
+#include <random>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+
+#include "Trace.h"
+
+// Primary sample space state of one Markov chain (Kelemen et al.): the random numbers a path was made
+// from. Numbers are created lazily when the tracer asks for them, so paths of any length work.
+// A large step draws all numbers anew, a small step moves each by a little Gaussian offset.
+// Rejecting restores the numbers changed in the iteration.
+class MetropolisSampler : public PrimarySampleSource {
+public:
+    float sigma = 0.01;
+    float largeStepProbability = 0.3;
+    bool largeStep = false;
+
+    MetropolisSampler(unsigned seed) : generator(seed) {}
+
+    // The first iteration is a large step, it makes the starting numbers.
+    void startIteration(){
+        currentIteration++;
+        largeStep = currentIteration == 1 || uniform() < largeStepProbability;
+        index = 0;
+    }
+
+    void accept(){
+        if( largeStep ) lastLargeStepIteration = currentIteration;
+    }
+
+    void reject(){
+        for( PrimarySample& x : samples )
+            if( x.lastModified == currentIteration ) x.restore();
+        currentIteration--;
+    }
+
+    float next() override{
+        if( index >= samples.size() ) samples.resize(index + 1);
+        PrimarySample& x = samples[index++];
+
+        // Numbers not used since the last large step are out of date, the large step would have replaced them.
+        if( x.lastModified < lastLargeStepIteration ){
+            x.value = uniform();
+            x.lastModified = lastLargeStepIteration;
+        }
+
+        x.backup();
+        if( largeStep ) x.value = uniform();
+        else {
+            // All the small steps missed since the last use at once, their offsets add up to one wider Gaussian.
+            long long smallSteps = currentIteration - x.lastModified;
+            x.value += normal(generator) * sigma * sqrtf((float)smallSteps);
+            x.value -= floorf(x.value);
+            if( x.value >= 1 ) x.value = 0;
+        }
+        x.lastModified = currentIteration;
+        return x.value;
+    }
+
+    float uniform(){ return std::uniform_real_distribution<float>(0, 1)(generator); }
+
+private:
+    struct PrimarySample {
+        float value = 0, valueBackup = 0;
+        long long lastModified = 0, lastModifiedBackup = 0;
+        void backup(){ valueBackup = value; lastModifiedBackup = lastModified; }
+        void restore(){ value = valueBackup; lastModified = lastModifiedBackup; }
+    };
+
+    std::vector<PrimarySample> samples;
+    std::mt19937 generator;
+    std::normal_distribution<float> normal;
+    long long currentIteration = 0, lastLargeStepIteration = 0;
+    int index = 0;
+};
+
+// Primary sample space Metropolis light transport on top of Trace::trace.
+// The first two numbers of a sample choose the film position, the tracer uses the rest as always.
+// Bootstrap samples estimate the image brightness and give the starting states of the chains,
+// which are proportional to the path luminance. Chains then run in parallel, each thread splats
+// into its own film, and the films are added at the end.
+// Uses the path tracer settings of trace (maxDepth, light selection), trace.samples is mutations per pixel.
+class MetropolisRenderer {
+public:
+    Trace& trace;
+    int bootstrapSamples = 100000;
+    int chains = 1024;
+    float sigma = 0.01;
+    float largeStepProbability = 0.3;
+    float acceptance = 0; // Of the last render.
+
+    MetropolisRenderer(Trace& ptrace) : trace(ptrace) {}
+
+    void render(std::vector<glm::vec4>& image){
+        trace.rendering = false;
+        unsigned int startTicks = SDL_GetTicks();
+        int pixelCount = trace.width * trace.height;
+
+        // Bootstrap: brightness of the image, and the states to start from.
+        std::vector<float> weights(bootstrapSamples);
+#pragma omp parallel for schedule(dynamic, 64)
+        for( int i = 0; i < bootstrapSamples; ++i ) {
+            MetropolisSampler sampler = makeSampler(i);
+            int pixel;
+            weights[i] = luminance(sample(sampler, pixel));
+        }
+        std::vector<float> cdf(bootstrapSamples + 1, 0);
+        for( int i = 0; i < bootstrapSamples; ++i ) cdf[i + 1] = cdf[i] + weights[i];
+        float brightness = cdf[bootstrapSamples] / bootstrapSamples;
+
+        std::vector<glm::vec3> film(pixelCount, glm::vec3(0, 0, 0));
+        long long mutations = (long long)trace.samples * pixelCount;
+        long long accepted = 0;
+        if( brightness > 0 ){
+#pragma omp parallel
+            {
+                std::vector<glm::vec3> threadFilm(pixelCount, glm::vec3(0, 0, 0));
+                long long threadAccepted = 0;
+#pragma omp for schedule(dynamic, 1)
+                for( int chain = 0; chain < chains; ++chain ) {
+                    long long chainMutations = mutations / chains + (chain < mutations % chains ? 1 : 0);
+                    threadAccepted += runChain(chain, chainMutations, cdf, threadFilm);
+                }
+#pragma omp critical
+                {
+                    for( int i = 0; i < pixelCount; ++i ) film[i] += threadFilm[i];
+                    accepted += threadAccepted;
+                }
+            }
+        }
+        acceptance = mutations > 0 ? (float)accepted / mutations : 0;
+
+        // Each mutation splats a total weight of 1, scaled so the average pixel has the bootstrap brightness.
+        float scale = brightness / trace.samples;
+#pragma omp parallel for
+        for( int i = 0; i < pixelCount; ++i ) {
+            glm::vec3 color = film[i] * scale;
+            image[i] = glm::vec4(color.x, color.y, color.z, 1.0f);
+        }
+
+        unsigned int endTicks = SDL_GetTicks();
+        trace.renderTime = (endTicks - startTicks) / 1000.0;
+    }
+
+private:
+    MetropolisSampler makeSampler(unsigned seed){
+        MetropolisSampler sampler(seed);
+        sampler.sigma = sigma;
+        sampler.largeStepProbability = largeStepProbability;
+        return sampler;
+    }
+
+    // Radiance of the path the sampler's current numbers make, and the pixel it goes to.
+    glm::vec3 sample(MetropolisSampler& sampler, int& pixel){
+        sampler.startIteration();
+        primarySamples = &sampler;
+        float x = randomFloat() * trace.width;
+        float y = randomFloat() * trace.height;
+        glm::vec3 radiance = trace.trace(trace.camera.getRay(x, y));
+        primarySamples = nullptr;
+
+        pixel = std::min((int)y, trace.height - 1) * trace.width + std::min((int)x, trace.width - 1);
+        // Rare NaNs and infinities would take over the chain.
+        if( !(luminance(radiance) >= 0) || std::isinf(luminance(radiance)) ) radiance = glm::vec3(0, 0, 0);
+        return radiance;
+    }
+
+    // Returns the number of accepted mutations.
+    long long runChain(int chain, long long chainMutations, const std::vector<float>& cdf, std::vector<glm::vec3>& film){
+        // Starting state, chosen from the bootstrap samples by luminance. Their samplers are seeded
+        // by index, so the same numbers come out again.
+        std::mt19937 chooser(chain + 0x9e3779b9u);
+        float u = std::uniform_real_distribution<float>(0, 1)(chooser) * cdf.back();
+        int start = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin() - 1;
+        start = glm::clamp(start, 0, (int)cdf.size() - 2);
+
+        MetropolisSampler sampler = makeSampler(start);
+        int currentPixel;
+        glm::vec3 current = sample(sampler, currentPixel);
+        sampler.accept();
+
+        long long accepted = 0;
+        for( long long i = 0; i < chainMutations; ++i ) {
+            int proposedPixel;
+            glm::vec3 proposed = sample(sampler, proposedPixel);
+            float currentY = luminance(current), proposedY = luminance(proposed);
+            float a = currentY > 0 ? std::min(1.0f, proposedY / currentY) : 1.0f;
+
+            // Expected values: both states get splatted, weighted by the acceptance probability.
+            if( proposedY > 0 ) film[proposedPixel] += proposed * (a / proposedY);
+            if( currentY > 0 ) film[currentPixel] += current * ((1 - a) / currentY);
+
+            if( sampler.uniform() < a ){
+                current = proposed;
+                currentPixel = proposedPixel;
+                sampler.accept();
+                accepted++;
+            }else sampler.reject();
+        }
+        return accepted;
+    }
+};
@@ -102,7 +102,7 @@ public:
         fin.close();        
     }
 
-    void add( Material* material, std::vector<Object*>& objects,
+    void add( MaterialId material, std::vector<Object*>& objects,
               glm::vec3 position = glm::vec3(0.0), glm::vec3 scale = glm::vec3(1.0), float rotX = 0, float rotY = 0, float rotZ = 0){
 
         glm::mat4 model = glm::identity<glm::mat4>();
@@ -116,6 +116,9 @@ public:
 
         glm::mat4 inverseModel = glm::inverse(model);
 
+        // Every added instance is its own mesh.
+        static int meshCount = 0;
+        int meshId = meshCount++;
 
 
         for( int i = 0; i < vertexFaces.size(); ++i){
@@ -126,6 +129,7 @@ public:
             glm::vec4 v3(vertices[face.z - 1], 1.0f); v3 = model * v3;
 
 
+            Triangle* triangle;
             if (hasnormals) {
                 auto normalFace = normalFaces[i];
                 glm::vec4 n1(normals[normalFace.x - 1], 0.0f); n1 = n1 * inverseModel;
@@ -133,7 +137,7 @@ public:
                 glm::vec4 n3(normals[normalFace.z - 1], 0.0f); n3 = n3 * inverseModel;
 
 
-                objects.push_back(
+                triangle =
                 new Triangle(
                     glm::vec3(v1.x, v1.y, v1.z),
                     glm::vec3(v2.x, v2.y, v2.z),
@@ -141,15 +145,23 @@ public:
                     material,
                     glm::vec3(n1.x, n1.y, n1.z),
                     glm::vec3(n2.x, n2.y, n2.z),
-                    glm::vec3(n3.x, n3.y, n3.z)) );
+                    glm::vec3(n3.x, n3.y, n3.z));
             }else{
-                objects.push_back(
+                triangle =
                 new Triangle(
                     glm::vec3(v1.x, v1.y, v1.z),
                     glm::vec3(v2.x, v2.y, v2.z),
                     glm::vec3(v3.x, v3.y, v3.z),
-                    material));
+                    material);
             }
+            if( !uvs.empty() ) {
+                glm::ivec3 uvFace = uvFaces[i];
+                if( uvFace.x > 0 && uvFace.y > 0 && uvFace.z > 0 &&
+                    uvFace.x <= uvs.size() && uvFace.y <= uvs.size() && uvFace.z <= uvs.size() )
+                    triangle->setUVs( uvs[uvFace.x - 1], uvs[uvFace.y - 1], uvs[uvFace.z - 1] );
+            }
+            triangle->meshId = meshId;
+            objects.push_back(triangle);
         }
     }
 
@@ -12,6 +12,8 @@
 #include "Material.h"
 #include "Ray.h"
 #include "AABB.h"
+#include "SphericalRectangle.h"
+#include "RayPacket.h"
 
 
 struct DirectionalLight {
@@ -30,10 +32,38 @@ struct Light {
 
 class Object{
 public:
-    Material * material;
+    MaterialId material = 0;
+    int objectId = 0; // Set by Trace::makeBVH, for the object ID mode.
+    virtual ~Object(){}
     virtual Hit intersect( const Ray& ray, float tMax ) = 0;
     virtual bool getAABB(AABB& aabb) const = 0;
 
+    // Any hit closer than tMax, for shadow rays.
+    virtual bool occluded( const Ray& ray, float tMax ){ return intersect(ray, tMax).valid; }
+
+    // Closest hits for the active rays of a packet, updating their hits and tMax.
+    virtual void intersectPacket( RayPacket& packet, PacketMask active ){
+        for( ; active; active &= active - 1 ) {
+            int i = __builtin_ctzll(active);
+            Hit hit = intersect(packet.ray(i), packet.tMax[i]);
+            if( hit.valid && hit.t < packet.tMax[i] ){
+                packet.hits[i] = hit;
+                packet.tMax[i] = hit.t;
+            }
+        }
+    }
+
+    // Occlusion for the active rays of a packet. Occluded rays get tMax 0, so they drop out.
+    virtual void occludedPacket( RayPacket& packet, PacketMask active ){
+        for( ; active; active &= active - 1 ) {
+            int i = __builtin_ctzll(active);
+            if( packet.tMax[i] > 0 && occluded(packet.ray(i), packet.tMax[i]) ){
+                packet.occluded[i] = true;
+                packet.tMax[i] = 0;
+            }
+        }
+    }
+
     // Bounding volume hierarchy building.
     virtual void build(std::vector<Object*>& objects, int start, int end){}
     virtual bool destroy(){ return false; }; // Only BVHnodes have to be deallocated.
@@ -41,6 +71,23 @@ public:
 
     virtual float pdf(glm::vec3 origin, const glm::vec3& toObject){ return 1.0; }
     virtual glm::vec3 randomPoint(){ return glm::vec3(1, 0, 0); }
+    // Direction from origin towards the object, distributed according to pdf.
+    virtual glm::vec3 randomDirection(const glm::vec3& origin){ return randomPoint() - origin; }
+
+    // For choosing between emitters by importance.
+    virtual float area() const { return 0; }
+    virtual float power() const { return luminance(materialTable[material].emit(Hit())) * area() * glm::pi<float>(); }
+    // Cone around the emitting side of the surface, cosTheta = -1 if it can face any direction.
+    virtual void normalCone(glm::vec3& axis, float& cosTheta) const { axis = glm::vec3(0, 0, 1); cosTheta = -1; }
+    // Uniform point on the surface with the normal of its emitting side, for tracing photons.
+    // Flat objects emit along their normal cone axis.
+    virtual glm::vec3 emissionPoint(glm::vec3& normal){
+        float cosTheta;
+        normalCone(normal, cosTheta);
+        return randomPoint();
+    }
+    // Corners of flat convex objects, for lighting them analytically. Returns how many, 0 for other shapes.
+    virtual int polygon(glm::vec3* corners) const { return 0; }
 };
 
 class Triangle : public Object {
@@ -53,8 +100,11 @@ class Triangle : public Object {
     glm::vec3 AC;
 
     bool hasnormals = false;
+    int meshId = -1; // Model the triangle belongs to, for grouping emissive meshes into lights.
+    glm::vec2 uv1, uv2, uv3; // Texture coordinates of the vertices.
+    float uvDensity;
     
-    Triangle( glm::vec3 pp1, glm::vec3 pp2, glm::vec3 pp3, Material* pmaterial,
+    Triangle( glm::vec3 pp1, glm::vec3 pp2, glm::vec3 pp3, MaterialId pmaterial,
               glm::vec3 pn1 = glm::vec3(-1000), glm::vec3 pn2 = glm::vec3(-1000), glm::vec3 pn3 = glm::vec3(-1000) ){
         p1 = pp1; p2 = pp2; p3 = pp3;
         n1 = pn1; n2 = pn2; n3 = pn3;
@@ -72,6 +122,13 @@ class Triangle : public Object {
         P = glm::inverse( P );
 
         material = pmaterial;
+        setUVs( glm::vec2(0, 0), glm::vec2(1, 0), glm::vec2(0, 1) );
+    }
+
+    void setUVs( glm::vec2 puv1, glm::vec2 puv2, glm::vec2 puv3 ){
+        uv1 = puv1; uv2 = puv2; uv3 = puv3;
+        float uvArea = 0.5f * glm::abs( (uv2.x - uv1.x) * (uv3.y - uv1.y) - (uv3.x - uv1.x) * (uv2.y - uv1.y) );
+        uvDensity = area() > 0 ? sqrtf( uvArea / area() ) : 0;
     }
 
     Hit intersect( const Ray& ray, float tMax) {
@@ -85,7 +142,7 @@ class Triangle : public Object {
 
         hit.t = -o.z / d.z;
 
-        if( hit.t < 0 || hit.t >= tMax) return hit; // Not valid.
+        if( hit.t <= ray.tMin || hit.t >= tMax) return hit; // Not valid.
 
         float u = o.x + hit.t * d.x;
         float v = o.y + hit.t * d.y;
@@ -94,6 +151,9 @@ class Triangle : public Object {
             hit.position = u * AB + v * AC + p1;
             float w = 1 - u - v;
             hit.object = this;
+            hit.material = material;
+            hit.uv = w * uv1 + u * uv2 + v * uv3;
+            hit.uvDensity = uvDensity;
 
             hit.normal = n;
             if( hasnormals )
@@ -128,7 +188,7 @@ class Triangle : public Object {
 
         float t = glm::dot(v0v2, qvec) * invDet;
 
-        if( t < 0 || t >= tMax) return hit; // Not valid.
+        if( t <= ray.tMin || t >= tMax) return hit; // Not valid.
 
         hit.t = t;
         hit.position = ray.start + ray.dir * t;
@@ -136,6 +196,7 @@ class Triangle : public Object {
         if( hasnormals )
             hit.normal = glm::normalize( u * n2 + v * n3 + (1-u-v) * n1 );
         hit.object = this;
+        hit.material = material;
         hit.valid = true;
 
         return hit;
@@ -146,7 +207,7 @@ class Triangle : public Object {
         // Intersection with the plane of the triangle.
         hit.t = (glm::dot(n, p1) - glm::dot(n, ray.start)) / glm::dot(n, ray.dir);
 
-        if(hit.t < 0 || hit.t >= tMax) return hit; // Not valid.
+        if(hit.t <= ray.tMin || hit.t >= tMax) return hit; // Not valid.
 
         // Point on the plane.
         glm::vec3 p = ray.start + hit.t * ray.dir;
@@ -161,6 +222,7 @@ class Triangle : public Object {
 
         hit.position = p;
         hit.object = this;
+        hit.material = material;
         hit.normal = n;
         hit.valid = true;
         return hit;
@@ -179,6 +241,23 @@ class Triangle : public Object {
         aabb = AABB(glm::vec3(xmin, ymin, zmin) - glm::vec3(eps), glm::vec3(xmax, ymax, zmax) + glm::vec3(eps));
         return true;
     }
+
+    float area() const override { return 0.5f * glm::length(glm::cross(AB, AC)); }
+
+    // Uniform point on the triangle.
+    glm::vec3 randomPoint() override{
+        float su = sqrtf(randomFloat());
+        float u = 1 - su;
+        float v = randomFloat() * su;
+        return p1 + u * AB + v * AC;
+    }
+
+    void normalCone(glm::vec3& axis, float& cosTheta) const override { axis = n; cosTheta = 1; }
+
+    int polygon(glm::vec3* corners) const override {
+        corners[0] = p1; corners[1] = p2; corners[2] = p3;
+        return 3;
+    }
 };
 
 // For lights, so it is easier to generateNewDir points on surface.
@@ -188,17 +267,18 @@ public:
     Triangle tri2;
     glm::vec3 p1, p2;
 
-    RectangleZ(glm::vec3 p1, glm::vec3 p2, Material* mat)
+    RectangleZ(glm::vec3 p1, glm::vec3 p2, MaterialId mat)
         : p1(p1), p2(p2),
         tri1( p1, glm::vec3(p1.x, p2.y, p1.z), glm::vec3(p2.x, p1.y, p1.z), mat ),
-        tri2( glm::vec3(p2.x, p1.y, p1.z), glm::vec3(p1.x, p2.y, p1.z), p2, mat ){};
+        tri2( glm::vec3(p2.x, p1.y, p1.z), glm::vec3(p1.x, p2.y, p1.z), p2, mat ){ material = mat; };
 
 
     Hit intersect( const Ray& ray, float tMax ){
         Hit hit1 = tri1.intersect(ray, tMax);
         Hit hit2 = tri2.intersect(ray, tMax);
-        if( hit1.t < hit2.t ) return hit1.valid ? hit1 : hit2;
-        else return hit2.valid ? hit2 : hit1;
+        Hit& hit = hit1.t < hit2.t ? (hit1.valid ? hit1 : hit2) : (hit2.valid ? hit2 : hit1);
+        if( hit.valid ) hit.object = this; // Not the triangle, lights are told apart by object.
+        return hit;
     };
 
     bool getAABB(AABB& aabb) const {
@@ -209,11 +289,18 @@ public:
         return true;
     }
 
+    SphericalRectangle sphericalRectangle(const glm::vec3& origin) const {
+        return SphericalRectangle(p1, glm::vec3(p2.x - p1.x, 0, 0), glm::vec3(0, p2.y - p1.y, 0), origin);
+    }
+
     float pdf(glm::vec3 origin, const glm::vec3 &newRayDir) override{
         Hit hit = this->intersect(Ray(origin + newRayDir * 0.001f, newRayDir ), infinity );
 
         if( !hit.valid ) return 0.0;
 
+        SphericalRectangle rect = sphericalRectangle(origin);
+        if( rect.valid() ) return rect.pdf();
+
         glm::vec3 toObject = hit.position - origin;
         float area = (p2.x - p1.x) * (p2.y - p1.y);
         float dist2 = length2(toObject);
@@ -226,6 +313,23 @@ public:
     glm::vec3 randomPoint() override{
         return glm::vec3(randomFloat(p1.x, p2.x), randomFloat(p1.y, p2.y), p1.z);
     }
+
+    // Uniform by solid angle, if the rectangle is not too small to do it accurately.
+    glm::vec3 randomDirection(const glm::vec3& origin) override{
+        SphericalRectangle rect = sphericalRectangle(origin);
+        if( rect.valid() ) return rect.sample(randomFloat(), randomFloat()) - origin;
+        return randomPoint() - origin;
+    }
+
+    float area() const override { return glm::abs((p2.x - p1.x) * (p2.y - p1.y)); }
+
+    void normalCone(glm::vec3& axis, float& cosTheta) const override { axis = tri1.n; cosTheta = 1; }
+
+    int polygon(glm::vec3* corners) const override {
+        corners[0] = p1; corners[1] = glm::vec3(p2.x, p1.y, p1.z);
+        corners[2] = p2; corners[3] = glm::vec3(p1.x, p2.y, p1.z);
+        return 4;
+    }
 };
 
 class RectangleX : public Object{
@@ -234,16 +338,17 @@ public:
     Triangle tri2;
     glm::vec3 p1, p2;
 
-    RectangleX(glm::vec3 p1, glm::vec3 p2, Material* mat)
+    RectangleX(glm::vec3 p1, glm::vec3 p2, MaterialId mat)
     : p1(p1), p2(p2),
     tri1( p1, glm::vec3(p1.x, p2.y, p1.z), glm::vec3(p1.x, p1.y, p2.z), mat ),
-    tri2( glm::vec3(p1.x, p1.y, p2.z), glm::vec3(p1.x, p2.y, p1.z), p2, mat ){};
+    tri2( glm::vec3(p1.x, p1.y, p2.z), glm::vec3(p1.x, p2.y, p1.z), p2, mat ){ material = mat; };
 
     Hit intersect( const Ray& ray, float tMax ){
         Hit hit1 = tri1.intersect(ray, tMax);
         Hit hit2 = tri2.intersect(ray, tMax);
-        if( hit1.t < hit2.t ) return hit1.valid ? hit1 : hit2;
-        else return hit2.valid ? hit2 : hit1;
+        Hit& hit = hit1.t < hit2.t ? (hit1.valid ? hit1 : hit2) : (hit2.valid ? hit2 : hit1);
+        if( hit.valid ) hit.object = this; // Not the triangle, lights are told apart by object.
+        return hit;
     };
 
     bool getAABB(AABB& aabb) const {
@@ -254,11 +359,18 @@ public:
         return true;
     }
 
+    SphericalRectangle sphericalRectangle(const glm::vec3& origin) const {
+        return SphericalRectangle(p1, glm::vec3(0, p2.y - p1.y, 0), glm::vec3(0, 0, p2.z - p1.z), origin);
+    }
+
     float pdf(glm::vec3 origin, const glm::vec3 &newRayDir) override{
         Hit hit = this->intersect(Ray(origin + newRayDir * 0.001f, newRayDir ), infinity );
 
         if( !hit.valid ) return 0.0;
 
+        SphericalRectangle rect = sphericalRectangle(origin);
+        if( rect.valid() ) return rect.pdf();
+
         glm::vec3 toObject = hit.position - origin;
         float area = (p2.z - p1.z) * (p2.y - p1.y);
         float dist2 = length2(toObject);
@@ -271,6 +383,23 @@ public:
     glm::vec3 randomPoint() override{
         return glm::vec3(p1.x, randomFloat(p1.y, p2.y), randomFloat(p1.z, p2.z));
     }
+
+    // Uniform by solid angle, if the rectangle is not too small to do it accurately.
+    glm::vec3 randomDirection(const glm::vec3& origin) override{
+        SphericalRectangle rect = sphericalRectangle(origin);
+        if( rect.valid() ) return rect.sample(randomFloat(), randomFloat()) - origin;
+        return randomPoint() - origin;
+    }
+
+    float area() const override { return glm::abs((p2.z - p1.z) * (p2.y - p1.y)); }
+
+    void normalCone(glm::vec3& axis, float& cosTheta) const override { axis = tri1.n; cosTheta = 1; }
+
+    int polygon(glm::vec3* corners) const override {
+        corners[0] = p1; corners[1] = glm::vec3(p1.x, p2.y, p1.z);
+        corners[2] = p2; corners[3] = glm::vec3(p1.x, p1.y, p2.z);
+        return 4;
+    }
 };
 
 
@@ -279,7 +408,7 @@ public:
     glm::vec3 center;
     float radius;
 
-    Sphere(const glm::vec3& pcenter, float pradius, Material* pmaterial) {
+    Sphere(const glm::vec3& pcenter, float pradius, MaterialId pmaterial) {
 		center = pcenter;
 		radius = pradius;
 		material = pmaterial;
@@ -296,12 +425,17 @@ public:
         float sqDiscr = sqrtf(discr);
         float t1 = (-b + sqDiscr) / 2.0f / a;
         float t2 = (-b - sqDiscr) / 2.0f / a;
-        if(t1 <= 0 ) return hit; // Not valid.
-        hit.t = (t2 > 0) ? t2 : t1;
+        if(t1 <= ray.tMin ) return hit; // Not valid.
+        hit.t = (t2 > ray.tMin) ? t2 : t1;
         if( hit.t >= tMax ) return hit; // Not valid.
         hit.position = ray.start + ray.dir * hit.t;
         hit.normal = (hit.position - center) * (1.0f / radius);
         hit.object = this;
+        hit.material = material;
+        // Longitude and latitude around the z axis.
+        hit.uv = glm::vec2( atan2f(hit.normal.y, hit.normal.x) / (2 * glm::pi<float>()) + 0.5f,
+                            1 - acosf(glm::clamp(hit.normal.z, -1.0f, 1.0f)) / glm::pi<float>() );
+        hit.uvDensity = 1.0f / sqrtf(area()); // The uv square covers the whole sphere.
         hit.valid = true;
         return hit;
     }
@@ -310,4 +444,118 @@ public:
         aabb = AABB(center - glm::vec3(radius), center + glm::vec3(radius));
         return true;
     }
+
+    float area() const override { return 4 * glm::pi<float>() * radius * radius; }
+
+    glm::vec3 randomPoint() override{
+        return center + radius * randomUnitVec3();
+    }
+
+    glm::vec3 emissionPoint(glm::vec3& normal) override{
+        normal = randomUnitVec3();
+        return center + radius * normal;
+    }
+
+    // Uniform in the cone of directions the sphere covers, seen from the origin.
+    glm::vec3 randomDirection(const glm::vec3& origin) override{
+        glm::vec3 toCenter = center - origin;
+        float dist2 = length2(toCenter);
+        if( dist2 <= radius * radius ) return randomPoint() - origin; // Inside.
+
+        float cosThetaMax = sqrtf(fmax(0.0f, 1 - radius * radius / dist2));
+        float cosTheta = 1 - randomFloat() * (1 - cosThetaMax);
+        float sinTheta = sqrtf(fmax(0.0f, 1 - cosTheta * cosTheta));
+        float phi = 2 * glm::pi<float>() * randomFloat();
+
+        ONB onb(toCenter / sqrtf(dist2));
+        return onb.get(glm::vec3(cosf(phi) * sinTheta, sinf(phi) * sinTheta, cosTheta));
+    }
+
+    float pdf(glm::vec3 origin, const glm::vec3 &newRayDir) override{
+        Hit hit = this->intersect(Ray(origin + newRayDir * 0.001f, newRayDir ), infinity );
+        if( !hit.valid ) return 0.0;
+
+        float dist2 = length2(center - origin);
+        if( dist2 <= radius * radius ){
+            float cosAlpha = glm::abs( glm::dot(newRayDir, hit.normal) );
+            return length2(hit.position - origin) / (cosAlpha * area());
+        }
+
+        // 1 - cos(thetaMax), written so it stays accurate for small spheres.
+        float sin2ThetaMax = radius * radius / dist2;
+        float oneMinusCos = sin2ThetaMax / (1 + sqrtf(fmax(0.0f, 1 - sin2ThetaMax)));
+        return 1 / (2 * glm::pi<float>() * oneMinusCos);
+    }
+};
+
+
+// Rectangle with any orientation, with corner p and perpendicular edges e1 and e2.
+// Emits on the side of cross(e1, e2).
+class OrientedRectangle : public Object {
+public:
+    glm::vec3 p, e1, e2, n;
+
+    OrientedRectangle(glm::vec3 pp, glm::vec3 pe1, glm::vec3 pe2, MaterialId mat) : p(pp), e1(pe1), e2(pe2) {
+        n = glm::normalize(glm::cross(e1, e2));
+        material = mat;
+    }
+
+    Hit intersect( const Ray& ray, float tMax ){
+        Hit hit;
+        float denom = glm::dot(n, ray.dir);
+        if( glm::abs(denom) < 1e-8f ) return hit;
+        float t = glm::dot(n, p - ray.start) / denom;
+        if( t <= ray.tMin || t >= tMax ) return hit; // Not valid.
+
+        glm::vec3 onPlane = ray.start + t * ray.dir;
+        float u = glm::dot(onPlane - p, e1) / length2(e1);
+        float v = glm::dot(onPlane - p, e2) / length2(e2);
+        if( u < 0 || u > 1 || v < 0 || v > 1 ) return hit;
+
+        hit.t = t;
+        hit.position = onPlane;
+        hit.normal = n;
+        hit.object = this;
+        hit.material = material;
+        hit.valid = true;
+        return hit;
+    }
+
+    bool getAABB(AABB& aabb) const {
+        glm::vec3 corners[3] = {p + e1, p + e2, p + e1 + e2};
+        aabb = AABB(p, p);
+        for( auto corner : corners ) aabb = aabb.add(AABB(corner, corner));
+        aabb = AABB(aabb.minimum - glm::vec3(eps), aabb.maximum + glm::vec3(eps));
+        return true;
+    }
+
+    float area() const override { return glm::length(glm::cross(e1, e2)); }
+
+    void normalCone(glm::vec3& axis, float& cosTheta) const override { axis = n; cosTheta = 1; }
+
+    int polygon(glm::vec3* corners) const override {
+        corners[0] = p; corners[1] = p + e1; corners[2] = p + e1 + e2; corners[3] = p + e2;
+        return 4;
+    }
+
+    glm::vec3 randomPoint() override{
+        return p + (float)randomFloat() * e1 + (float)randomFloat() * e2;
+    }
+
+    glm::vec3 randomDirection(const glm::vec3& origin) override{
+        SphericalRectangle rect(p, e1, e2, origin);
+        if( rect.valid() ) return rect.sample(randomFloat(), randomFloat()) - origin;
+        return randomPoint() - origin;
+    }
+
+    float pdf(glm::vec3 origin, const glm::vec3 &newRayDir) override{
+        Hit hit = this->intersect(Ray(origin + newRayDir * 0.001f, newRayDir ), infinity );
+        if( !hit.valid ) return 0.0;
+
+        SphericalRectangle rect(p, e1, e2, origin);
+        if( rect.valid() ) return rect.pdf();
+
+        float cosAlpha = glm::abs( glm::dot(newRayDir, n) );
+        return length2(hit.position - origin) / (cosAlpha * area());
+    }
 };
\ No newline at end of file
@@ -1,7 +1,13 @@
 #pragma once
 
+#include "LightBVH.h"
+#include "LightList.h"
+#include "EnvironmentMap.h"
+#include "PathGuide.h"
+
 class PDF{
 public:
+    virtual ~PDF() {}
     virtual float pdf(const Hit& hit, const glm::vec3& newRayDir){return 1.0;}
     virtual glm::vec3 generateNewDir(){ return glm::vec3(0, 0, 0); }
 };
@@ -35,8 +41,7 @@ public:
     }
 
     glm::vec3 generateNewDir() {
-        glm::vec3 onObject = object->randomPoint();
-        return onObject - origin;
+        return object->randomDirection(origin);
     }
 };
 
@@ -62,29 +67,131 @@ public:
 
     glm::vec3 generateNewDir() override {
         int i = randomInt(0, objects.size() - 1);
-        glm::vec3 onObject = objects[i]->randomPoint();
-        return onObject - origin;
+        return objects[i]->randomDirection(origin);
+    }
+};
+
+// Chooses an emitter by importance through the light BVH.
+class LightBVHPDF : public PDF{
+public:
+    const LightBVH& lightBVH;
+    glm::vec3 origin, normal;
+
+    LightBVHPDF(const LightBVH& plightBVH, const glm::vec3& porigin, const glm::vec3& pnormal )
+        : lightBVH(plightBVH), origin(porigin), normal(pnormal) {}
+
+    float pdf(const Hit& hit, const glm::vec3& newRayDir) override{
+        return lightBVH.pdf(hit.position, normal, newRayDir);
+    }
+
+    // Returns a zero vector if no emitter can light the origin.
+    glm::vec3 generateNewDir() override {
+        float pmf;
+        int i = lightBVH.sample(origin, normal, randomFloat(), pmf);
+        if( i < 0 ) return glm::vec3(0, 0, 0);
+        return lightBVH.lights[i]->randomDirection(origin);
+    }
+};
+
+// Chooses an emitter proportional to its power with the alias table.
+// The light BVH is only used to find the emitters a direction hits.
+class PowerLightPDF : public PDF{
+public:
+    const LightList& lightList;
+    const LightBVH& lightBVH;
+    glm::vec3 origin;
+
+    PowerLightPDF(const LightList& plightList, const LightBVH& plightBVH, const glm::vec3& porigin )
+        : lightList(plightList), lightBVH(plightBVH), origin(porigin) {}
+
+    float pdf(const Hit& hit, const glm::vec3& newRayDir) override{
+        const AliasTable& table = lightList.emitterTable;
+        return lightBVH.pdf(hit.position, newRayDir, [&table](int i){ return table.pmf(i); });
+    }
+
+    glm::vec3 generateNewDir() override {
+        float pmf;
+        int i = lightList.emitterTable.sample(randomFloat(), pmf);
+        return lightList.emitters[i]->randomDirection(origin);
     }
 };
 
+class EnvironmentPDF : public PDF {
+public:
+    const EnvironmentMap& environment;
+    EnvironmentPDF(const EnvironmentMap& penvironment) : environment(penvironment){}
+
+    float pdf(const Hit& hit, const glm::vec3& newRayDir) override{
+        return environment.pdf(glm::normalize(newRayDir));
+    }
+
+    glm::vec3 generateNewDir() override{
+        float pdf;
+        return environment.sample(pdf);
+    }
+};
+
+// Directions learned by the path guide, in one of its cells. The guide knows light from all sides,
+// directions below the surface are mirrored above it, so none is wasted.
+class GuidePDF : public PDF {
+public:
+    const PathGuide& guide;
+    int cell;
+    glm::vec3 normal;
+    GuidePDF(const PathGuide& pguide, int pcell, const glm::vec3& pnormal) : guide(pguide), cell(pcell), normal(pnormal){}
+
+    float pdf(const Hit& hit, const glm::vec3& newRayDir) override{
+        glm::vec3 dir = glm::normalize(newRayDir);
+        float cos = dot(dir, normal);
+        if( cos < 0 ) return 0;
+        return guide.pdf(cell, dir) + guide.pdf(cell, dir - 2 * cos * normal);
+    }
+
+    glm::vec3 generateNewDir() override{
+        glm::vec3 dir = guide.sample(cell);
+        float cos = dot(dir, normal);
+        return cos < 0 ? dir - 2 * cos * normal : dir;
+    }
+};
+
+// Chooses one of the pdfs by weight. The pdf of a direction is the weighted sum,
+// which is one sample MIS with the balance heuristic.
 class MixturePDF : PDF {
 public:
-    PDF* pdfs[2];
+    std::vector<PDF*> pdfs;
+    std::vector<float> weights;
+
+    MixturePDF(){}
 
     MixturePDF(PDF* pdf1, PDF* pdf2){
-        pdfs[0] = pdf1;
-        pdfs[1] = pdf2;
+        add(pdf1, 0.5);
+        add(pdf2, 0.5);
+    }
+
+    void add(PDF* pdf, float weight){
+        pdfs.push_back(pdf);
+        weights.push_back(weight);
+    }
+
+    // Weights have to sum to 1.
+    void normalize(){
+        float sum = 0;
+        for( float w : weights ) sum += w;
+        for( float& w : weights ) w /= sum;
     }
 
     float pdf(const Hit& hit, const glm::vec3& newRayDir) override{
-        return 0.5 * pdfs[0]->pdf(hit, newRayDir) + 0.5 * pdfs[1]->pdf(hit, newRayDir);
+        float sum = 0;
+        for( int i = 0; i < pdfs.size(); ++i ) sum += weights[i] * pdfs[i]->pdf(hit, newRayDir);
+        return sum;
     }
 
     glm::vec3 generateNewDir() override{
-        if( randomFloat() < 0.5 ){
-            return pdfs[0]->generateNewDir();
-        }else{
-            return pdfs[1]->generateNewDir();
+        float u = randomFloat();
+        for( int i = 0; i < pdfs.size() - 1; ++i ) {
+            if( u < weights[i] ) return pdfs[i]->generateNewDir();
+            u -= weights[i];
         }
+        return pdfs.back()->generateNewDir();
     }
-};
\ No newline at end of file
+};
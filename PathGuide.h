@@ -0,0 +1,274 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+#include <glm/ext/scalar_constants.hpp>
+
+#include "AABB.h"
+#include "RandomVector.h"
+
+// Incident light over the directions at a region of the scene, as a quadtree over the square of
+// (cos theta, phi), which maps the sphere with equal area. Each node keeps the light of its four quadrants,
+// a quadrant without a child node is a leaf. Bright directions get finer quadrants.
+class DirectionTree {
+public:
+    struct Node {
+        std::atomic<float> sums[4];
+        uint32_t children[4] = {0, 0, 0, 0}; // Index of the node of the quadrant, 0 for none (the root is no child).
+
+        Node(){ for( auto& s : sums ) s = 0; }
+        Node( const Node& other ){ *this = other; }
+        Node& operator=( const Node& other ){
+            for( int q = 0; q < 4; ++q ) {
+                sums[q] = other.sums[q].load(std::memory_order_relaxed);
+                children[q] = other.children[q];
+            }
+            return *this;
+        }
+        float total() const { return sums[0] + sums[1] + sums[2] + sums[3]; }
+    };
+
+    std::vector<Node> nodes;
+    std::atomic<uint32_t> records;
+
+    DirectionTree() : nodes(1){ records = 0; }
+    DirectionTree( const DirectionTree& other ) : nodes(other.nodes){ records = other.records.load(); }
+    DirectionTree& operator=( const DirectionTree& other ){
+        nodes = other.nodes;
+        records = other.records.load();
+        return *this;
+    }
+
+    // Adds the light to the quadrants along the way to the leaf of the direction, from any thread.
+    void record( const glm::vec3& dir, float value ){
+        glm::vec2 p = toSquare(dir);
+        uint32_t node = 0;
+        while( true ) {
+            int q = quadrant(p);
+            std::atomic<float>& sum = nodes[node].sums[q];
+            float old = sum.load(std::memory_order_relaxed);
+            while( !sum.compare_exchange_weak(old, old + value, std::memory_order_relaxed) );
+            node = nodes[node].children[q];
+            if( node == 0 ) break;
+        }
+        records.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Picks a quadrant by its light at each level, uniform inside the leaf (or a node without light).
+    glm::vec3 sample() const {
+        glm::vec2 origin(0, 0);
+        float size = 1;
+        uint32_t node = 0;
+        while( true ) {
+            const Node& n = nodes[node];
+            float total = n.total();
+            if( !(total > 0) ) break;
+            float u = randomFloat() * total;
+            int q = 0;
+            while( q < 3 && u >= n.sums[q] ) u -= n.sums[q++];
+            while( !(n.sums[q] > 0) ) q--; // Rounding can leave u past the last quadrant with light.
+            size *= 0.5f;
+            origin += glm::vec2(q & 1, q >> 1) * size;
+            node = n.children[q];
+            if( node == 0 ) break;
+        }
+        return fromSquare(origin + glm::vec2(randomFloat(), randomFloat()) * size);
+    }
+
+    float pdf( const glm::vec3& dir ) const {
+        glm::vec2 p = toSquare(dir);
+        float density = 1;
+        uint32_t node = 0;
+        while( true ) {
+            const Node& n = nodes[node];
+            float total = n.total();
+            if( !(total > 0) ) break;
+            int q = quadrant(p);
+            density *= 4 * n.sums[q] / total;
+            node = n.children[q];
+            if( node == 0 ) break;
+        }
+        return density / (4 * glm::pi<float>());
+    }
+
+    // The tree for the next iteration: quadrants with more than a fraction of the light of this one
+    // are split, the others are merged into leaves. Starts without light.
+    DirectionTree refined( float fraction, int maxDepth ) const {
+        DirectionTree tree;
+        float total = nodes[0].total();
+        if( !(total > 0) ) return tree;
+        refine(tree, 0, 0, 1, 0, total * fraction, maxDepth);
+        for( auto& n : tree.nodes ) for( auto& s : n.sums ) s = 0;
+        return tree;
+    }
+
+    float light() const { return nodes[0].total(); }
+
+private:
+    // Copies the light of the old node (or spreads the light of a leaf quadrant when it is -1) into the new one
+    // and refines its quadrants.
+    void refine( DirectionTree& tree, uint32_t target, int64_t source, float spread, int depth, float threshold, int maxDepth ) const {
+        for( int q = 0; q < 4; ++q ) {
+            float sum = source >= 0 ? nodes[source].sums[q].load() : spread / 4;
+            tree.nodes[target].sums[q] = sum;
+            if( sum <= threshold || depth + 1 >= maxDepth ) continue;
+            uint32_t child = tree.nodes.size();
+            tree.nodes.push_back(Node());
+            tree.nodes[target].children[q] = child;
+            uint32_t old = source >= 0 ? nodes[source].children[q] : 0;
+            refine(tree, child, old ? (int64_t)old : -1, sum, depth + 1, threshold, maxDepth);
+        }
+    }
+
+    static int quadrant( glm::vec2& p ){
+        int q = 0;
+        if( p.x >= 0.5f ){ q |= 1; p.x -= 0.5f; }
+        if( p.y >= 0.5f ){ q |= 2; p.y -= 0.5f; }
+        p *= 2.0f;
+        return q;
+    }
+
+    static glm::vec2 toSquare( const glm::vec3& dir ){
+        float phi = atan2f(dir.y, dir.x);
+        if( phi < 0 ) phi += 2 * glm::pi<float>();
+        return glm::vec2(glm::clamp((dir.z + 1) * 0.5f, 0.0f, 0.99999f), glm::clamp(phi / (2 * glm::pi<float>()), 0.0f, 0.99999f));
+    }
+
+    static glm::vec3 fromSquare( const glm::vec2& p ){
+        float cosTheta = p.x * 2 - 1, phi = p.y * 2 * glm::pi<float>();
+        float sinTheta = sqrtf(fmax(0.0f, 1 - cosTheta * cosTheta));
+        return glm::vec3(sinTheta * cosf(phi), sinTheta * sinf(phi), cosTheta);
+    }
+};
+
+// Learned incident light for path guiding, an SD-tree (Muller et al., Practical Path Guiding): a binary tree
+// over the scene bounds, halved along x, y and z in turn, with a direction tree in each leaf.
+// The guide learns online in iterations of 1, 2, 4, ... passes of the render. Paths of an iteration sample
+// the trees of the one before (sampling, fixed while the pass runs) and add their light to the training
+// trees from all threads with atomic adds. After an iteration, spatial leaves with many records are split
+// and the direction trees are refined where they have much light, so the trees get finer with more samples.
+class PathGuide {
+public:
+    static const int spatialThreshold = 4000; // Records a leaf may take in an iteration of one pass, times sqrt(passes) for longer ones.
+    static constexpr float directionFraction = 0.01f; // Quadrants with more light than this are split.
+    static const int maxDirectionDepth = 16;
+
+    bool training = false;
+
+    void init( const AABB& pbox ){
+        // A cube a bit larger than the bounds, so its halves stay about cubes and points on the bounds fall inside.
+        glm::vec3 center = (pbox.minimum + pbox.maximum) * 0.5f;
+        glm::vec3 extent = pbox.maximum - pbox.minimum;
+        float size = fmax(fmax(extent.x, extent.y), extent.z) * 1.002f + 1e-4f;
+        origin = center - glm::vec3(size * 0.5f);
+        scale = 1 / size;
+        training = true;
+        spatial.assign(1, SpatialNode());
+        trees.assign(1, DirectionTree());
+        samplingSpatial.clear();
+        samplingTrees.clear();
+        passes = trainedPasses = 0;
+        iterationPasses = 1;
+    }
+
+    void clear(){
+        spatial.clear();
+        trees.clear();
+        samplingSpatial.clear();
+        samplingTrees.clear();
+        training = false;
+    }
+
+    // Contribution estimate (luminance / pdf) of a path leaving p in the direction, to the training trees.
+    void record( const glm::vec3& p, const glm::vec3& dir, float value ){
+        if( !(value >= 0) || std::isinf(value) ) return;
+        int leaf = find(spatial, p);
+        if( leaf >= 0 ) trees[leaf].record(dir, value);
+    }
+
+    // Called after each pass of the render. Ends the iteration when it has its passes, and stops training
+    // when the next iteration would go past the budget of passes.
+    void endPass( int budget ){
+        if( !training ) return;
+        if( ++passes < iterationPasses ) return;
+        update();
+        trainedPasses += passes;
+        passes = 0;
+        iterationPasses *= 2;
+        if( trainedPasses + iterationPasses > budget ) training = false;
+    }
+
+    // Direction tree to sample at the point, or -1 before the first iteration is done.
+    int samplingCell( const glm::vec3& p ) const {
+        if( samplingSpatial.empty() ) return -1;
+        int leaf = find(samplingSpatial, p);
+        return leaf >= 0 && samplingTrees[leaf].light() > 0 ? leaf : -1;
+    }
+
+    glm::vec3 sample( int c ) const { return samplingTrees[c].sample(); }
+
+    float pdf( int c, const glm::vec3& dir ) const { return samplingTrees[c].pdf(dir); }
+
+    int leaves() const { return trees.size(); }
+
+private:
+    struct SpatialNode {
+        uint32_t children[2] = {0, 0}; // 0 for a leaf.
+        int tree = 0; // Direction tree of a leaf.
+    };
+
+    glm::vec3 origin;
+    float scale = 1;
+    std::vector<SpatialNode> spatial, samplingSpatial;
+    std::vector<DirectionTree> trees, samplingTrees;
+    int passes = 0, iterationPasses = 1, trainedPasses = 0;
+
+    // Direction tree of the leaf the point is in, or -1 outside.
+    int find( const std::vector<SpatialNode>& nodes, const glm::vec3& point ) const {
+        glm::vec3 p = (point - origin) * scale;
+        if( !(p.x >= 0 && p.y >= 0 && p.z >= 0 && p.x < 1 && p.y < 1 && p.z < 1) ) return -1;
+        uint32_t node = 0;
+        int axis = 0;
+        while( nodes[node].children[0] ) {
+            int side = p[axis] >= 0.5f;
+            p[axis] = p[axis] * 2 - side;
+            node = nodes[node].children[side];
+            axis = (axis + 1) % 3;
+        }
+        return nodes[node].tree;
+    }
+
+    // The trees learned in this iteration are sampled in the next one. The training trees get finer where
+    // this one had many records and much light.
+    void update(){
+        samplingSpatial = spatial;
+        samplingTrees = trees;
+        for( size_t t = 0; t < trees.size(); ++t ) {
+            trees[t] = samplingTrees[t].refined(directionFraction, maxDirectionDepth);
+            trees[t].records = samplingTrees[t].records.load();
+        }
+
+        // Halves keep the direction tree and half of the records, they are split again if that is still too many.
+        uint32_t threshold = (uint32_t)(spatialThreshold * sqrtf((float)iterationPasses));
+        for( size_t node = 0; node < spatial.size(); ++node ) {
+            int tree = spatial[node].tree;
+            if( spatial[node].children[0] || trees[tree].records <= threshold ) continue;
+            trees[tree].records = trees[tree].records / 2;
+            SpatialNode first, second;
+            first.tree = tree;
+            second.tree = trees.size();
+            DirectionTree half = trees[tree];
+            trees.push_back(half);
+            spatial[node].children[0] = spatial.size();
+            spatial[node].children[1] = spatial.size() + 1;
+            spatial.push_back(first);
+            spatial.push_back(second);
+        }
+        for( auto& t : trees ) t.records = 0;
+    }
+};
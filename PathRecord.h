@@ -0,0 +1,88 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+#include "Material.h"
+#include "Texture.h"
+
+const MaterialId noAlbedo = 0xFFFF; // Vertices whose albedo doesn't count: glass, the background.
+
+// One vertex of a recorded camera path, with the albedo of its material left out of what it adds (direct)
+// and of what it passes on from the rest of the path (factor). The path's radiance is the sum of
+// throughput * albedo * direct over the vertices, with throughput *= albedo * factor after each one.
+// The directions and pdfs don't depend on the albedos, so the path can be evaluated again for edited ones.
+struct PathVertex {
+    MaterialId material;
+    uint16_t first; // 1 where a camera path starts.
+    uint16_t direct[3], factor[3]; // Half floats.
+
+    PathVertex( MaterialId pmaterial, const glm::vec3& pdirect, const glm::vec3& pfactor, bool pfirst ){
+        material = pmaterial;
+        first = pfirst;
+        for( int c = 0; c < 3; ++c ) {
+            direct[c] = floatToHalf(std::min(pdirect[c], 65504.0f));
+            factor[c] = floatToHalf(std::min(pfactor[c], 65504.0f));
+        }
+    }
+
+    glm::vec3 getDirect() const { return glm::vec3(halfToFloat(direct[0]), halfToFloat(direct[1]), halfToFloat(direct[2])); }
+    glm::vec3 getFactor() const { return glm::vec3(halfToFloat(factor[0]), halfToFloat(factor[1]), halfToFloat(factor[2])); }
+};
+
+// Bit of a material in the masks of materials met, the ones from 63 on share the last bit.
+inline uint64_t materialBit( MaterialId material ){ return 1ull << std::min<int>(material, 63); }
+
+// What Trace::shade records on the thread, while vertices is set. The materials met are always added up.
+struct PathRecorder {
+    std::vector<PathVertex>* vertices = nullptr;
+    uint64_t materials = 0;
+    bool first = true; // The next vertex starts a path.
+
+    void record( MaterialId material, const glm::vec3& direct, const glm::vec3& factor ){
+        if( !vertices ) return;
+        vertices->push_back(PathVertex(material, direct, factor, first));
+        first = false;
+    }
+};
+
+thread_local PathRecorder pathRecorder;
+
+// Recorded paths of the pixels of the render loop, for path replay.
+class PathRecords {
+public:
+    std::vector<std::vector<PathVertex>> paths;
+    std::vector<uint64_t> materials; // Of all samples of a pixel, recorded or not.
+
+    // Keeps the memory of the paths, the next recording is about as large.
+    void clear( int pixelCount ){
+        paths.resize(pixelCount);
+        for( auto& p : paths ) p.clear();
+        materials.assign(pixelCount, 0);
+    }
+
+    // The recorded paths of the pixel added up with the albedos of the materials, and their count.
+    glm::vec3 replay( int pixel, const std::vector<Material>& albedos, int& count ) const {
+        glm::vec3 sum(0, 0, 0), throughput(1, 1, 1);
+        count = 0;
+        for( const PathVertex& vertex : paths[pixel] ) {
+            if( vertex.first ){
+                throughput = glm::vec3(1, 1, 1);
+                count++;
+            }
+            glm::vec3 albedo = vertex.material == noAlbedo ? glm::vec3(1, 1, 1) : albedos[vertex.material].albedo;
+            sum += throughput * albedo * vertex.getDirect();
+            throughput *= albedo * vertex.getFactor();
+        }
+        return sum;
+    }
+
+    size_t memory() const {
+        size_t bytes = materials.size() * sizeof(uint64_t);
+        for( const auto& p : paths ) bytes += sizeof(p) + p.capacity() * sizeof(PathVertex);
+        return bytes;
+    }
+};
@@ -0,0 +1,376 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+#include "Trace.h"
+
+// Stochastic progressive photon mapping, for caustics the path tracer can't find:
+// light reaching a diffuse surface through glass or mirrors only.
+// Each pass traces one camera path per pixel to its first diffuse hit (the visible point), with
+// direct light estimated there, then traces photons from the lights and the background (environment map or
+// gradient), which is then lit like a light far around the scene. A photon landing within the
+// gather radius of a visible point adds its flux to it. After the pass the radius of each pixel
+// shrinks, so the estimate becomes sharp while the noise goes down.
+// trace.maxDepth limits the camera paths and the photon paths each, so paths can be longer than in Trace::trace.
+class PhotonMapper {
+public:
+    Trace& trace;
+    int photonsPerPass = 0; // 0: as many as there are pixels.
+    float initialRadius = 4.0; // In pixel footprints at the visible point.
+    float alpha = 0.7; // Fraction of the new photons kept when shrinking the radius.
+    int passes = 0; // Done so far.
+    bool rendering = false;
+
+    PhotonMapper(Trace& ptrace) : trace(ptrace) {}
+
+    // Render trace.samples passes in one go.
+    void render(std::vector<glm::vec4>& image){
+        trace.rendering = false;
+        rendering = false;
+        unsigned int startTicks = SDL_GetTicks();
+        reset();
+        for( int i = 0; i < trace.samples; ++i ) {
+            std::cout << (float)i / trace.samples * 100.0 << "                \r";
+            pass();
+        }
+        resolve(image);
+        unsigned int endTicks = SDL_GetTicks();
+        trace.renderTime = (endTicks - startTicks) / 1000.0;
+        std::cout << "100                \r";
+    }
+
+    // Progressive rendering, one pass per frame until stopped.
+    void startRenderLoop(){
+        trace.rendering = false;
+        reset();
+        rendering = true;
+        startTicksLoop = SDL_GetTicks();
+    }
+
+    void renderLoop(Texture& texture){
+        if( !rendering ) return;
+        // Resized, the scene or lighting changed under the samples, or the camera moved: the radii and flux
+        // of the pixels are of other surfaces.
+        if( points.size() != trace.width * trace.height || trace.sceneVersion != sceneVersion || trace.settingsVersion != settingsVersion ||
+            trace.camera.eye != eye || trace.camera.lookat != lookat || trace.camera.fov != fov || trace.camera.aperture != aperture ) reset();
+        pass();
+        resolve(pixels);
+        texture.setRect(0, 0, trace.width, trace.height, pixels);
+        trace.renderTime = (SDL_GetTicks() - startTicksLoop) / 1000.0;
+    }
+
+private:
+    // Camera path end of a pixel in the current pass.
+    struct VisiblePoint {
+        glm::vec3 position, normal;
+        glm::vec3 weight; // Camera path throughput times the BRDF.
+        bool valid = false;
+    };
+
+    // What a pixel keeps over the passes.
+    struct PixelStats {
+        glm::vec3 direct = glm::vec3(0, 0, 0); // Sum of the direct estimates.
+        glm::vec3 tau = glm::vec3(0, 0, 0); // Flux gathered within the current radius.
+        float radius = 0; // 0 until the pixel had a visible point.
+        float n = 0; // Photons kept.
+    };
+
+    std::vector<VisiblePoint> points;
+    std::vector<PixelStats> stats;
+    std::unique_ptr<std::atomic<float>[]> flux; // Of this pass, 3 per pixel.
+    std::unique_ptr<std::atomic<int>[]> photonCounts;
+    std::vector<glm::vec4> pixels;
+    unsigned int startTicksLoop = 0;
+    int sceneVersion = -1, settingsVersion = -1; // Of trace, when reset.
+    glm::vec3 eye, lookat;
+    float fov = 0, aperture = 0;
+    // Background photons start on a disk of the size of the scene's bounding sphere, outside it.
+    glm::vec3 sceneCenter;
+    float sceneRadius = 0;
+    float backgroundPower = 0; // Luminance flux of the background into that sphere, 0 when it is black.
+
+    // Hash grid of the visible points. The points of bucket b are gridPoints[gridStart[b] .. gridStart[b + 1]).
+    std::vector<int> gridStart, gridPoints;
+    float cellSize = 1;
+    glm::vec3 gridOrigin;
+
+    void keepCamera(){
+        eye = trace.camera.eye;
+        lookat = trace.camera.lookat;
+        fov = trace.camera.fov;
+        aperture = trace.camera.aperture;
+    }
+
+    void reset(){
+        int pixelCount = trace.width * trace.height;
+        points.assign(pixelCount, VisiblePoint());
+        stats.assign(pixelCount, PixelStats());
+        flux.reset(new std::atomic<float>[pixelCount * 3]);
+        photonCounts.reset(new std::atomic<int>[pixelCount]);
+        pixels.resize(pixelCount);
+        passes = 0;
+        sceneVersion = trace.sceneVersion;
+        settingsVersion = trace.settingsVersion;
+        keepCamera();
+
+        AABB box;
+        trace.bvh.getAABB(box);
+        sceneCenter = 0.5f * (box.minimum + box.maximum);
+        sceneRadius = 0.5f * glm::length(box.maximum - box.minimum);
+        // Mean radiance of the background over the sphere of directions, from a grid uniform in z and phi.
+        const int n = 32;
+        float mean = 0;
+        for( int i = 0; i < n; ++i )
+            for( int j = 0; j < n; ++j ) {
+                float z = 1 - 2 * (i + 0.5f) / n, r = sqrtf(fmax(0.0f, 1 - z * z)), phi = 2 * glm::pi<float>() * (j + 0.5f) / n;
+                mean += luminance(trace.backgroundColor(Ray(sceneCenter, glm::vec3(r * cosf(phi), r * sinf(phi), z))));
+            }
+        mean /= n * n;
+        backgroundPower = mean * 4 * glm::pi<float>() * glm::pi<float>() * sceneRadius * sceneRadius;
+    }
+
+    void pass(){
+        int pixelCount = trace.width * trace.height;
+#pragma omp parallel for schedule(dynamic, 64)
+        for( int i = 0; i < pixelCount; ++i ) {
+            flux[3 * i] = flux[3 * i + 1] = flux[3 * i + 2] = 0;
+            photonCounts[i] = 0;
+            tracePixel(i);
+        }
+
+        buildGrid();
+        int photons = photonsCount();
+        if( !gridPoints.empty() ){
+            std::vector<float> powers;
+            for( const auto& entry : trace.lightList.entries ) powers.push_back(entry.power);
+            powers.push_back(backgroundPower); // The last one.
+            AliasTable lightTable;
+            lightTable.build(powers);
+            if( !lightTable.empty() ){
+#pragma omp parallel for schedule(dynamic, 256)
+                for( int i = 0; i < photons; ++i )
+                    tracePhoton(lightTable);
+            }
+        }
+
+        // Shrink the radii of the pixels that got photons.
+#pragma omp parallel for
+        for( int i = 0; i < pixelCount; ++i ) {
+            PixelStats& s = stats[i];
+            int m = photonCounts[i];
+            if( m == 0 ) continue;
+            float newN = s.n + alpha * m;
+            float newRadius = s.radius * sqrtf(newN / (s.n + m));
+            glm::vec3 phi(flux[3 * i].load(), flux[3 * i + 1].load(), flux[3 * i + 2].load());
+            s.tau = (s.tau + phi) * (newRadius * newRadius) / (s.radius * s.radius);
+            s.n = newN;
+            s.radius = newRadius;
+        }
+        passes++;
+    }
+
+    int photonsCount() const { return photonsPerPass > 0 ? photonsPerPass : trace.width * trace.height; }
+
+    void resolve(std::vector<glm::vec4>& out){
+        int pixelCount = trace.width * trace.height;
+        double photons = (double)passes * photonsCount();
+#pragma omp parallel for
+        for( int i = 0; i < pixelCount; ++i ) {
+            const PixelStats& s = stats[i];
+            glm::vec3 color = s.direct / (float)passes;
+            if( s.radius > 0 ) color += s.tau / float(photons * glm::pi<float>() * s.radius * s.radius);
+            out[i] = glm::vec4(color.x, color.y, color.z, 1.0f);
+        }
+    }
+
+    // Follows the camera ray through mirrors and glass to a diffuse hit, adding emission and direct light on the way.
+    void tracePixel(int i){
+        int x = i % trace.width, y = i / trace.width;
+        Ray ray = trace.camera.getRay(float(x) + randomFloat(), float(y) + randomFloat());
+        VisiblePoint& point = points[i];
+        PixelStats& s = stats[i];
+        point.valid = false;
+
+        glm::vec3 throughput(1, 1, 1);
+        for( int depth = 1; depth <= trace.maxDepth; ++depth ) {
+            Hit hit = trace.firstIntersect(ray);
+            if( !hit.valid ){
+                s.direct += throughput * trace.backgroundColor(ray);
+                return;
+            }
+            const Material& material = materialTable[hit.material];
+            if( material.emissive() ){
+                s.direct += throughput * material.emit(hit);
+                return;
+            }
+
+            glm::vec3 attenuation;
+            float pdf;
+            Ray newRay = material.scatter(ray, hit, attenuation, pdf);
+            if( attenuation.x < 0 ) return;
+            if( material.noPdf() ){
+                throughput *= attenuation;
+                trace.continueCone(ray, hit, newRay);
+                ray = newRay;
+                continue;
+            }
+
+            // Direct light: point lights, and one direction from the light / cosine mixture that finds an emitter.
+            // Light through glass and mirrors, and bounced light, comes from the photons.
+            glm::vec3 direct = trace.sampleEmitters(ray, hit);
+            trace.addPointShadow(hit, direct);
+            s.direct += throughput * direct;
+
+            point.position = hit.position;
+            point.normal = hit.normal;
+            point.weight = throughput * attenuation / glm::pi<float>();
+            point.valid = true;
+            if( s.radius == 0 ) s.radius = initialRadius * fmax(hit.coneWidth, 1e-5f);
+            return;
+        }
+    }
+
+    static uint32_t hashCell(int x, int y, int z, int buckets){
+        return ((uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u ^ (uint32_t)z * 83492791u) % (uint32_t)buckets;
+    }
+
+    glm::ivec3 cellOf(const glm::vec3& p) const {
+        glm::vec3 f = (p - gridOrigin) / cellSize;
+        return glm::ivec3((int)floorf(f.x), (int)floorf(f.y), (int)floorf(f.z));
+    }
+
+    // Each visible point goes to every cell its gather sphere overlaps. The cells are twice the
+    // average radius, so a point is usually in at most 8 of them.
+    void buildGrid(){
+        int pixelCount = points.size();
+        double radiusSum = 0;
+        int validCount = 0;
+        gridOrigin = glm::vec3(infinity);
+        for( int i = 0; i < pixelCount; ++i ) {
+            if( !points[i].valid ) continue;
+            radiusSum += stats[i].radius;
+            validCount++;
+            gridOrigin = glm::min(gridOrigin, points[i].position);
+        }
+        gridPoints.clear();
+        if( validCount == 0 ) return;
+        cellSize = fmax(2 * radiusSum / validCount, 1e-6);
+
+        // Counting sort into the buckets: count, prefix sum, fill.
+        int buckets = pixelCount;
+        gridStart.assign(buckets + 1, 0);
+        std::vector<uint32_t> pointBuckets;
+        for( int pass = 0; pass < 2; ++pass ) {
+            if( pass == 1 ){
+                for( int b = 0; b < buckets; ++b ) gridStart[b + 1] += gridStart[b];
+                gridPoints.resize(gridStart[buckets]);
+            }
+            for( int i = 0; i < pixelCount; ++i ) {
+                if( !points[i].valid ) continue;
+                glm::vec3 r(stats[i].radius);
+                glm::ivec3 lo = cellOf(points[i].position - r), hi = cellOf(points[i].position + r);
+                pointBuckets.clear();
+                for( int z = lo.z; z <= hi.z; ++z )
+                    for( int y = lo.y; y <= hi.y; ++y )
+                        for( int x = lo.x; x <= hi.x; ++x )
+                            pointBuckets.push_back(hashCell(x, y, z, buckets));
+                // Once per bucket, or a photon would be counted twice when two cells collide.
+                std::sort(pointBuckets.begin(), pointBuckets.end());
+                pointBuckets.erase(std::unique(pointBuckets.begin(), pointBuckets.end()), pointBuckets.end());
+                for( uint32_t b : pointBuckets ) {
+                    if( pass == 0 ) gridStart[b + 1]++;
+                    else gridPoints[--gridStart[b + 1]] = i;
+                }
+            }
+        }
+        // Filling moved each end down to the start of its bucket, one entry too far up.
+        for( int b = 0; b < buckets; ++b ) gridStart[b] = gridStart[b + 1];
+        gridStart[buckets] = gridPoints.size();
+    }
+
+    static void atomicAdd(std::atomic<float>& sum, float value){
+        float old = sum.load(std::memory_order_relaxed);
+        while( !sum.compare_exchange_weak(old, old + value, std::memory_order_relaxed) );
+    }
+
+    // Adds the photon to the visible points around the hit.
+    void deposit(const Hit& hit, const glm::vec3& photonFlux){
+        glm::ivec3 c = cellOf(hit.position);
+        uint32_t b = hashCell(c.x, c.y, c.z, points.size());
+        for( int k = gridStart[b]; k < gridStart[b + 1]; ++k ) {
+            int i = gridPoints[k];
+            const VisiblePoint& point = points[i];
+            float r = stats[i].radius;
+            // Same side of the surface, so light doesn't leak through thin walls.
+            if( length2(point.position - hit.position) > r * r || glm::dot(point.normal, hit.normal) <= 0 ) continue;
+            glm::vec3 phi = point.weight * photonFlux;
+            atomicAdd(flux[3 * i], phi.x);
+            atomicAdd(flux[3 * i + 1], phi.y);
+            atomicAdd(flux[3 * i + 2], phi.z);
+            photonCounts[i].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Emits a photon from a light (or the background) chosen by power and follows it through the scene.
+    void tracePhoton(const AliasTable& lightTable){
+        float pmf;
+        int index = lightTable.sample(randomFloat(), pmf);
+        Ray ray(glm::vec3(0, 0, 0), glm::vec3(0, 0, 1));
+        glm::vec3 photonFlux;
+        if( index == (int)trace.lightList.entries.size() ){
+            // A direction towards the background, a point on the disk facing it, inwards from there.
+            // Flux = radiance * disk area / pdf of the direction.
+            float pdf = 1 / (4 * glm::pi<float>());
+            glm::vec3 dir = trace.environment.loaded() ? trace.environment.sample(pdf) : randomUnitVec3();
+            if( !(pdf > 0) ) return;
+            glm::vec3 origin = sceneCenter + sceneRadius * (dir + ONB(dir).get(randomUnitDiskVec3()));
+            ray = Ray(origin, -dir);
+            photonFlux = trace.backgroundColor(Ray(origin, dir)) * glm::pi<float>() * sceneRadius * sceneRadius / (pdf * pmf);
+        }else if( trace.lightList.entries[index].point ){
+            const LightList::Entry& entry = trace.lightList.entries[index];
+            const Light& light = trace.lights[entry.index];
+            ray = Ray(light.position, randomUnitVec3());
+            // Surfaces reflect albedo * power / (4 pi d^2) in unshadowedPointLight, that is a total flux of pi * power.
+            photonFlux = light.power * glm::pi<float>() / pmf;
+        }else{
+            // Cosine distributed from a uniform point: flux = Le * area * pi.
+            Object* emitter = trace.lightList.emitters[trace.lightList.entries[index].index];
+            glm::vec3 normal;
+            glm::vec3 p = emitter->emissionPoint(normal);
+            ray = Ray(p + normal * eps, CosinePDF(normal).generateNewDir());
+            photonFlux = materialTable[emitter->material].emit(Hit()) * emitter->area() * glm::pi<float>() / pmf;
+        }
+
+        for( int depth = 1; depth <= trace.maxDepth; ++depth ) {
+            Hit hit = trace.firstIntersect(ray);
+            if( !hit.valid ) return;
+            const Material& material = materialTable[hit.material];
+            if( material.emissive() ) return;
+
+            glm::vec3 attenuation;
+            float pdf;
+            Ray newRay = material.scatter(ray, hit, attenuation, pdf);
+            if( attenuation.x < 0 ) return;
+            if( material.noPdf() ){
+                photonFlux *= attenuation;
+                ray = newRay;
+                continue;
+            }
+
+            // Light straight from the lights is the direct estimate of the camera pass.
+            if( depth > 1 ) deposit(hit, photonFlux);
+
+            // Russian roulette by albedo, cosine weighted bounce.
+            float survive = fmin(1.0f, fmax(attenuation.x, fmax(attenuation.y, attenuation.z)));
+            if( randomFloat() >= survive ) return;
+            photonFlux *= attenuation / survive;
+            ray = Ray(hit.position + hit.normal * eps, CosinePDF(hit.normal).generateNewDir());
+        }
+    }
+};
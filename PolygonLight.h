@@ -0,0 +1,34 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cmath>
+
+// Irradiance at point p with normal n from a convex polygon of radiance 1 (Lambert's formula).
+// The polygon is clipped to the hemisphere above p first. The winding does not matter, only one side
+// of a light emits, that is up to the caller.
+// For diffuse surfaces this is what linearly transformed cosines give, their transform is the identity.
+inline float polygonIrradiance(const glm::vec3* vertices, int count, const glm::vec3& p, const glm::vec3& n){
+    // Sutherland-Hodgman against the tangent plane, a convex polygon gains at most one vertex.
+    glm::vec3 clipped[9];
+    int clippedCount = 0;
+    for( int i = 0; i < count && i < 8; ++i ) {
+        glm::vec3 a = vertices[i] - p, b = vertices[(i + 1) % count] - p;
+        float da = glm::dot(a, n), db = glm::dot(b, n);
+        if( da >= 0 ) clipped[clippedCount++] = a;
+        if( (da >= 0) != (db >= 0) ) clipped[clippedCount++] = a + (b - a) * (da / (da - db));
+    }
+    if( clippedCount < 3 ) return 0;
+
+    // Each edge adds its angle times the cosine of the plane through it and p.
+    // atan2 instead of acos, small lights have edges at tiny angles.
+    float sum = 0;
+    for( int i = 0; i < clippedCount; ++i ) {
+        glm::vec3 a = glm::normalize(clipped[i]), b = glm::normalize(clipped[(i + 1) % clippedCount]);
+        glm::vec3 c = glm::cross(a, b);
+        float sinAngle = glm::length(c);
+        if( sinAngle < 1e-12f ) continue;
+        float angle = atan2f(sinAngle, glm::dot(a, b));
+        sum += angle * glm::dot(c, n) / sinAngle;
+    }
+    return 0.5f * fabs(sum);
+}
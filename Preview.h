@@ -0,0 +1,102 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "Trace.h"
+#include "Texture.h"
+
+// Interactive preview of the direct lighting mode (traceDirectOnly): the whole image every frame, one ray
+// through each pixel center, primary and shadow rays traced in 8x8 packets.
+// The internal resolution follows the frame time, so frames stay near targetFps, and the texture is
+// made at that size and stretched over the window (linear filtering).
+class PreviewRenderer {
+public:
+    Trace& trace;
+    bool rendering = false;
+    bool dynamicResolution = true;
+    float targetFps = 30;
+    float minScale = 0.125; // Smallest internal resolution, as a part of the window size.
+    float scale = 0.5; // Internal resolution of the next frame.
+    float frameTime = 0; // Seconds for tracing the last frame.
+    int internalWidth = 0, internalHeight = 0;
+
+    PreviewRenderer(Trace& ptrace) : trace(ptrace) {}
+
+    void startRenderLoop(){
+        trace.rendering = false;
+        rendering = true;
+        internalWidth = internalHeight = 0; // Make the texture anew.
+    }
+
+    void renderLoop(Texture& texture){
+        if( !rendering ) return;
+        unsigned int startTicks = SDL_GetTicks();
+
+        int w = std::max(1, (int)ceilf(trace.width * scale)), h = std::max(1, (int)ceilf(trace.height * scale));
+        pixels.resize(w * h);
+        int tilesX = (w + 7) / 8, tilesY = (h + 7) / 8;
+#pragma omp parallel for schedule(dynamic)
+        for( int i = 0; i < tilesX * tilesY; ++i ) {
+            int x0 = (i % tilesX) * 8, y0 = (i / tilesX) * 8;
+            renderTile(x0, y0, std::min(8, w - x0), std::min(8, h - y0), w, h);
+        }
+
+        // The same size is updated in place, a new size makes a new texture.
+        if( w == internalWidth && h == internalHeight ) texture.setRect(0, 0, w, h, pixels);
+        else texture.create(w, h, pixels);
+        internalWidth = w;
+        internalHeight = h;
+
+        frameTime = (SDL_GetTicks() - startTicks) / 1000.0f;
+        trace.renderTime = frameTime;
+        if( dynamicResolution ) adjustScale();
+    }
+
+private:
+    std::vector<glm::vec4> pixels;
+
+    // Time goes with the pixel count, the square of the scale. Changes are limited, so one slow frame
+    // (or a millisecond timer reading 0) doesn't make the resolution jump.
+    void adjustScale(){
+        float budget = 1 / targetFps;
+        float factor = frameTime > 0 ? sqrtf(budget / frameTime) : 1.25f;
+        factor = glm::clamp(factor, 0.8f, 1.25f);
+        scale = glm::clamp(scale * factor, minScale, 1.0f);
+    }
+
+    // Tile of the internal image, of size w x h.
+    void renderTile(int x0, int y0, int tw, int th, int w, int h){
+        int n = tw * th;
+
+        // Camera coordinates are in window pixels.
+        float sx = float(trace.width) / w, sy = float(trace.height) / h;
+        RayPacket packet;
+        packet.size = n;
+        for( int j = 0; j < n; ++j )
+            packet.set(j, trace.camera.getRay((x0 + j % tw + 0.5f) * sx, (y0 + j / tw + 0.5f) * sy));
+        glm::vec3 corners[4] = { trace.camera.getRay(x0 * sx, y0 * sy).dir, trace.camera.getRay((x0 + tw) * sx, y0 * sy).dir,
+                                 trace.camera.getRay((x0 + tw) * sx, (y0 + th) * sy).dir, trace.camera.getRay(x0 * sx, (y0 + th) * sy).dir };
+        packet.setFrustum(trace.camera.eye, corners);
+        trace.bvh.intersectPacket(packet, firstRays(n));
+        for( int j = 0; j < n; ++j ) trace.orientHit(packet.ray(j), packet.hits[j]);
+
+        RayPacket shadowPacket;
+        shadowPacket.size = n;
+        PacketMask hitting = 0;
+        for( int j = 0; j < n; ++j ) {
+            const Hit& hit = packet.hits[j];
+            if( !hit.valid ) continue;
+            shadowPacket.set(j, Ray(hit.position + hit.normal * trace.eps, trace.dLight.direction));
+            hitting |= PacketMask(1) << j;
+        }
+        trace.bvh.occludedPacket(shadowPacket, hitting);
+
+        for( int j = 0; j < n; ++j ) {
+            const Hit& hit = packet.hits[j];
+            glm::vec3 color = trace.shadeDirect(packet.ray(j), hit, hit.valid && shadowPacket.occluded[j]);
+            pixels[(y0 + j / tw) * w + x0 + j % tw] = glm::vec4(color.x, color.y, color.z, 1.0f);
+        }
+    }
+};
@@ -2,7 +2,18 @@
 
 #include <chrono>
 
+// Supplies the random numbers of a thread instead of the generator, while set as primarySamples.
+// Metropolis rendering drives the tracer with its own mutated numbers this way.
+class PrimarySampleSource {
+public:
+    virtual ~PrimarySampleSource(){}
+    virtual float next() = 0;
+};
+
+thread_local PrimarySampleSource* primarySamples = nullptr;
+
 inline double randomFloat() {
+    if( primarySamples ) return primarySamples->next();
     static std::uniform_real_distribution<float> distribution(0.0, 1.0);
     static unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
     static std::mt19937 generator(seed);
@@ -25,6 +36,10 @@ inline float length2(glm::vec3 v){
     return glm::dot(v, v);
 }
 
+inline float luminance(const glm::vec3& color){
+    return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
 inline glm::vec3 randomInSphereVec3(){
     while(true){
         glm::vec3 dir = randomVec3(-1, 1);
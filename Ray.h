@@ -1,9 +1,13 @@
 #pragma once
 
 #include <limits>
+#include <cstdint>
 
 struct Ray {
     glm::vec3 start, dir;
+    // Ray cone, for choosing texture MIP levels: width at the start and spread angle.
+    float coneWidth = 0, coneAngle = 0;
+    float tMin = 0; // Hits at this distance or closer don't count, for walking past surfaces along the ray.
     Ray(glm::vec3 pstart, glm::vec3 pdir) {
         start = pstart;
         dir = glm::normalize( pdir );
@@ -12,10 +16,17 @@ struct Ray {
 
 class Object;
 
+typedef uint16_t MaterialId; // Index into the material table.
+
 struct Hit {
     glm::vec3 position, normal;
     Object * object;
+    MaterialId material = 0;
     float t = std::numeric_limits<float>::infinity();
     bool valid = false;
     bool frontFace = true;
+    glm::vec2 uv = glm::vec2(0, 0);
+    float uvDensity = 0; // Change of uv per unit length on the surface.
+    float coneWidth = 0; // Width of the ray cone at the hit.
+    float footprint = 0; // Width of the ray cone on the surface, in uv units.
 };
\ No newline at end of file
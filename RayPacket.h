@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#if defined(__SSE__) || defined(_M_X64)
+#define RAYPACKET_SSE 1
+#include <xmmintrin.h>
+#endif
+
+#include "Ray.h"
+#include "AABB.h"
+
+const int maxPacketSize = 64; // 8x8 tile.
+
+// Bit i is set for the rays i of a packet that are still traced.
+typedef uint64_t PacketMask;
+
+// Mask of the first n rays.
+inline PacketMask firstRays(int n){ return n >= 64 ? ~PacketMask(0) : (PacketMask(1) << n) - 1; }
+
+// Coherent rays traced through the BVH together, stored as structure of arrays so the box tests
+// go over lanes of 4 rays at once.
+struct RayPacket {
+    static const int lanes = 4; // SIMD width of the box tests.
+    int size = 0;
+    alignas(16) float ox[maxPacketSize];
+    alignas(16) float oy[maxPacketSize];
+    alignas(16) float oz[maxPacketSize];
+    alignas(16) float invDx[maxPacketSize];
+    alignas(16) float invDy[maxPacketSize];
+    alignas(16) float invDz[maxPacketSize];
+    alignas(16) float tMax[maxPacketSize];
+    float coneAngle[maxPacketSize];
+    glm::vec3 dirs[maxPacketSize];
+    Hit hits[maxPacketSize];
+    bool occluded[maxPacketSize];
+
+    // Planes through a common origin, bounding all rays of the packet (only for camera rays without aperture).
+    bool hasFrustum = false;
+    glm::vec3 frustumOrigin;
+    glm::vec3 frustumNormals[4];
+
+    void set(int i, const Ray& ray, float ptMax = infinity){
+        ox[i] = ray.start.x; oy[i] = ray.start.y; oz[i] = ray.start.z;
+        invDx[i] = 1.0f / ray.dir.x; invDy[i] = 1.0f / ray.dir.y; invDz[i] = 1.0f / ray.dir.z;
+        dirs[i] = ray.dir;
+        coneAngle[i] = ray.coneAngle;
+        tMax[i] = ptMax;
+        hits[i] = Hit();
+        occluded[i] = false;
+    }
+
+    Ray ray(int i) const {
+        Ray r(glm::vec3(ox[i], oy[i], oz[i]), dirs[i]);
+        r.coneAngle = coneAngle[i];
+        return r;
+    }
+
+    // Frustum of the rays from origin through the corner directions (given in order around the tile).
+    void setFrustum(const glm::vec3& origin, const glm::vec3 corners[4]){
+        hasFrustum = true;
+        frustumOrigin = origin;
+        glm::vec3 center = corners[0] + corners[1] + corners[2] + corners[3];
+        for( int i = 0; i < 4; ++i ) {
+            frustumNormals[i] = glm::cross(corners[i], corners[(i + 1) % 4]);
+            if( glm::dot(frustumNormals[i], center) < 0 ) frustumNormals[i] = -frustumNormals[i];
+        }
+    }
+
+    // True if the box is completely outside the frustum, so no ray of the packet can hit it.
+    bool frustumCulls(const AABB& box) const {
+        if( !hasFrustum ) return false;
+        for( int i = 0; i < 4; ++i ) {
+            const glm::vec3& n = frustumNormals[i];
+            // Corner of the box furthest along the normal.
+            glm::vec3 p( n.x >= 0 ? box.maximum.x : box.minimum.x,
+                         n.y >= 0 ? box.maximum.y : box.minimum.y,
+                         n.z >= 0 ? box.maximum.z : box.minimum.z );
+            if( glm::dot(n, p - frustumOrigin) < 0 ) return true;
+        }
+        return false;
+    }
+
+    bool intersect(const AABB& box, int i) const {
+        float t0x = (box.minimum.x - ox[i]) * invDx[i], t1x = (box.maximum.x - ox[i]) * invDx[i];
+        float t0y = (box.minimum.y - oy[i]) * invDy[i], t1y = (box.maximum.y - oy[i]) * invDy[i];
+        float t0z = (box.minimum.z - oz[i]) * invDz[i], t1z = (box.maximum.z - oz[i]) * invDz[i];
+        float tmin = fmax(fmax(fmin(t0x, t1x), fmin(t0y, t1y)), fmax(fmin(t0z, t1z), 0.0f));
+        float tmax = fmin(fmin(fmax(t0x, t1x), fmax(t0y, t1y)), fmin(fmax(t0z, t1z), tMax[i]));
+        return tmax > tmin;
+    }
+
+    // The active rays that hit the box. The rays are tested in groups of lanes, groups without an active
+    // ray are skipped. Rays that aren't active may hold anything, their results are masked out.
+    PacketMask hitMask(const AABB& box, PacketMask active) const {
+        PacketMask hits = 0;
+        for( int first = 0; first < maxPacketSize; first += lanes ) {
+            PacketMask group = (active >> first) & ((1 << lanes) - 1);
+            if( group ) hits |= (PacketMask)(hitLanes(box, first) & group) << first;
+        }
+        return hits;
+    }
+
+    // Bits of the rays first .. first + lanes - 1 that hit the box.
+    int hitLanes(const AABB& box, int first) const {
+#ifdef RAYPACKET_SSE
+        __m128 o = _mm_load_ps(ox + first), inv = _mm_load_ps(invDx + first);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.minimum.x), o), inv);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.maximum.x), o), inv);
+        __m128 tmin = _mm_max_ps(_mm_min_ps(t0, t1), _mm_setzero_ps());
+        __m128 tmax = _mm_min_ps(_mm_max_ps(t0, t1), _mm_load_ps(tMax + first));
+
+        o = _mm_load_ps(oy + first); inv = _mm_load_ps(invDy + first);
+        t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.minimum.y), o), inv);
+        t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.maximum.y), o), inv);
+        tmin = _mm_max_ps(_mm_min_ps(t0, t1), tmin);
+        tmax = _mm_min_ps(_mm_max_ps(t0, t1), tmax);
+
+        o = _mm_load_ps(oz + first); inv = _mm_load_ps(invDz + first);
+        t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.minimum.z), o), inv);
+        t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.maximum.z), o), inv);
+        tmin = _mm_max_ps(_mm_min_ps(t0, t1), tmin);
+        tmax = _mm_min_ps(_mm_max_ps(t0, t1), tmax);
+        return _mm_movemask_ps(_mm_cmpgt_ps(tmax, tmin));
+#else
+        int bits = 0;
+        for( int l = 0; l < lanes; ++l ) bits |= intersect(box, first + l) << l;
+        return bits;
+#endif
+    }
+
+    // Whether the active rays go to negative coordinates along the axis. The rays of a packet mostly go
+    // the same way, the first active one stands for them.
+    bool negative(PacketMask active, int axis) const {
+        return dirs[__builtin_ctzll(active)][axis] < 0;
+    }
+};
@@ -0,0 +1,312 @@
+#pragma once
+
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+
+#include "Trace.h"
+
+// Candidate light sample: a point on an emitter, or a point light.
+struct LightSample {
+    glm::vec3 position, normal;
+    glm::vec3 emission; // Radiance of the emitter, power of a point light.
+    bool point = false;
+};
+
+// Weighted reservoir sampling: keeps one of the candidates streamed through it, chosen by weight,
+// and the weight sum and candidate count needed to weight the kept one.
+struct Reservoir {
+    LightSample sample;
+    float weightSum = 0;
+    float M = 0; // Candidates seen.
+    float W = 0; // Unbiased contribution weight of the sample (1 / pdf estimate).
+
+    bool update(const LightSample& candidate, float weight){
+        weightSum += weight;
+        M += 1;
+        if( weight > 0 && randomFloat() * weightSum < weight ){
+            sample = candidate;
+            return true;
+        }
+        return false;
+    }
+};
+
+// Direct lighting with spatiotemporal reservoir resampling (ReSTIR, Bitterli et al.).
+// Each pass, every pixel streams light candidates (chosen by power from trace.lightList) into a reservoir
+// by their unshadowed contribution and tests the visibility of the one kept. Reservoirs are then combined
+// with the pixel's reservoir of the last pass and with a few neighbours on similar surfaces, and one more
+// shadow ray is traced for the sample that wins. Neighbours are combined without visibility tests, the
+// biased variant, which darkens a little at shadow borders.
+// The first diffuse hit is found through mirrors and glass, only direct light is computed there.
+class ReservoirRenderer {
+public:
+    Trace& trace;
+    int candidates = 32; // Light samples per pixel and pass.
+    bool visibilityReuse = true;
+    bool temporalReuse = true;
+    float historyLimit = 20; // Candidates the last pass counts for, in multiples of candidates.
+    bool spatialReuse = true;
+    int spatialNeighbours = 5;
+    float spatialRadius = 20; // Pixels, for the 900 pixel window.
+    int passes = 0; // Done so far, they are averaged.
+    bool rendering = false;
+
+    ReservoirRenderer(Trace& ptrace) : trace(ptrace) {}
+
+    // Render trace.samples passes in one go.
+    void render(std::vector<glm::vec4>& image){
+        trace.rendering = false;
+        rendering = false;
+        unsigned int startTicks = SDL_GetTicks();
+        reset();
+        for( int i = 0; i < trace.samples; ++i ) pass();
+        resolve(image);
+        unsigned int endTicks = SDL_GetTicks();
+        trace.renderTime = (endTicks - startTicks) / 1000.0;
+    }
+
+    // Progressive rendering, one pass per frame until stopped.
+    void startRenderLoop(){
+        trace.rendering = false;
+        reset();
+        rendering = true;
+        startTicksLoop = SDL_GetTicks();
+    }
+
+    void renderLoop(Texture& texture){
+        if( !rendering ) return;
+        // Resized, or the scene or lighting changed under the samples.
+        if( surfaces.size() != trace.width * trace.height || trace.sceneVersion != sceneVersion || trace.settingsVersion != settingsVersion ) reset();
+        // The camera moved or the lens changed, start averaging again. Reservoirs are kept for temporal reuse.
+        if( trace.camera.eye != eye || trace.camera.lookat != lookat || trace.camera.fov != fov || trace.camera.aperture != aperture ){
+            std::fill(sum.begin(), sum.end(), glm::vec3(0, 0, 0));
+            passes = 0;
+            keepCamera();
+        }
+        pass();
+        resolve(pixels);
+        texture.setRect(0, 0, trace.width, trace.height, pixels);
+        trace.renderTime = (SDL_GetTicks() - startTicksLoop) / 1000.0;
+    }
+
+private:
+    // First diffuse hit of a pixel.
+    struct Surface {
+        glm::vec3 position, normal;
+        glm::vec3 albedo;
+        glm::vec3 throughput; // Of the mirrors and glass on the way.
+        float depth = 0; // Distance from the camera.
+        bool valid = false;
+    };
+
+    std::vector<Surface> surfaces, previousSurfaces;
+    std::vector<Reservoir> reservoirs, previous, spatial;
+    std::vector<glm::vec3> sum; // Of all passes.
+    std::vector<glm::vec4> pixels;
+    AliasTable lightTable;
+    unsigned int startTicksLoop = 0;
+    int sceneVersion = -1, settingsVersion = -1; // Of trace, when reset.
+    glm::vec3 eye, lookat;
+    float fov = 0, aperture = 0;
+
+    void keepCamera(){
+        eye = trace.camera.eye;
+        lookat = trace.camera.lookat;
+        fov = trace.camera.fov;
+        aperture = trace.camera.aperture;
+    }
+
+    void reset(){
+        int pixelCount = trace.width * trace.height;
+        surfaces.assign(pixelCount, Surface());
+        previousSurfaces.assign(pixelCount, Surface());
+        reservoirs.assign(pixelCount, Reservoir());
+        previous.assign(pixelCount, Reservoir());
+        spatial.assign(pixelCount, Reservoir());
+        sum.assign(pixelCount, glm::vec3(0, 0, 0));
+        pixels.resize(pixelCount);
+        passes = 0;
+        sceneVersion = trace.sceneVersion;
+        settingsVersion = trace.settingsVersion;
+        keepCamera();
+
+        std::vector<float> powers;
+        for( const auto& entry : trace.lightList.entries ) powers.push_back(entry.power);
+        lightTable.build(powers);
+    }
+
+    void pass(){
+        int pixelCount = trace.width * trace.height;
+
+        // Candidates, then the reservoir of the last pass at the same pixel.
+        surfaces.swap(previousSurfaces);
+#pragma omp parallel for schedule(dynamic, 64)
+        for( int i = 0; i < pixelCount; ++i ) {
+            sum[i] += findSurface(i);
+            Reservoir& r = reservoirs[i];
+            r = Reservoir();
+            const Surface& s = surfaces[i];
+            if( !s.valid ) continue;
+
+            for( int c = 0; c < candidates && !lightTable.empty(); ++c ) {
+                float pdf;
+                LightSample candidate = sampleLight(pdf);
+                r.update(candidate, targetPdf(s, candidate) / pdf);
+            }
+            finish(r, s);
+            // Visibility reuse: an occluded winner keeps its candidate count but no weight,
+            // so neighbours and the next pass see how much of the light is shadowed here.
+            if( visibilityReuse && r.W > 0 && !visible(s, r.sample) ) r.weightSum = r.W = 0;
+
+            // The history is limited, so the passes that are averaged don't become too alike.
+            if( temporalReuse && previous[i].M > 0 && similar(s, previousSurfaces[i]) ){
+                Reservoir history = previous[i];
+                history.M = std::min(history.M, historyLimit * candidates);
+                combine(r, history, s);
+                finish(r, s);
+            }
+        }
+
+        // Neighbours with a similar surface.
+#pragma omp parallel for schedule(dynamic, 64)
+        for( int i = 0; i < pixelCount; ++i ) {
+            spatial[i] = reservoirs[i];
+            const Surface& s = surfaces[i];
+            if( !spatialReuse || !s.valid ) continue;
+            int x = i % trace.width, y = i / trace.width;
+            for( int k = 0; k < spatialNeighbours; ++k ) {
+                float angle = 2 * glm::pi<float>() * randomFloat();
+                float radius = spatialRadius * sqrtf(randomFloat());
+                int nx = x + (int)roundf(cosf(angle) * radius), ny = y + (int)roundf(sinf(angle) * radius);
+                if( nx < 0 || ny < 0 || nx >= trace.width || ny >= trace.height ) continue;
+                int n = ny * trace.width + nx;
+                if( n == i || !similar(s, surfaces[n]) ) continue;
+                combine(spatial[i], reservoirs[n], s);
+            }
+            finish(spatial[i], s);
+        }
+
+        // One shadow ray for each winner. The next pass reuses the reservoirs from before the neighbours
+        // were added, the bias of combining them would add up over the passes.
+#pragma omp parallel for schedule(dynamic, 64)
+        for( int i = 0; i < pixelCount; ++i ) {
+            const Reservoir& r = spatial[i];
+            const Surface& s = surfaces[i];
+            if( s.valid && r.W > 0 && visible(s, r.sample) ) sum[i] += s.throughput * contribution(s, r.sample) * r.W;
+        }
+        previous.swap(reservoirs);
+        passes++;
+    }
+
+    void resolve(std::vector<glm::vec4>& out){
+        int pixelCount = trace.width * trace.height;
+#pragma omp parallel for
+        for( int i = 0; i < pixelCount; ++i ) {
+            glm::vec3 color = sum[i] / (float)passes;
+            out[i] = glm::vec4(color.x, color.y, color.z, 1.0f);
+        }
+    }
+
+    // Follows the camera ray through mirrors and glass to a diffuse hit. Returns the emission or background
+    // seen on the way.
+    glm::vec3 findSurface(int i){
+        int x = i % trace.width, y = i / trace.width;
+        Ray ray = trace.camera.getRay(float(x) + randomFloat(), float(y) + randomFloat());
+        Surface& s = surfaces[i];
+        s.valid = false;
+        s.throughput = glm::vec3(1, 1, 1);
+        s.depth = 0;
+
+        for( int depth = 1; depth <= trace.maxDepth; ++depth ) {
+            Hit hit = trace.firstIntersect(ray);
+            if( !hit.valid ) return s.throughput * trace.backgroundColor(ray);
+            s.depth += hit.t;
+            const Material& material = materialTable[hit.material];
+            if( material.emissive() ) return s.throughput * material.emit(hit);
+
+            glm::vec3 attenuation;
+            float pdf;
+            Ray newRay = material.scatter(ray, hit, attenuation, pdf);
+            if( attenuation.x < 0 ) return glm::vec3(0, 0, 0);
+            if( material.noPdf() ){
+                s.throughput *= attenuation;
+                trace.continueCone(ray, hit, newRay);
+                ray = newRay;
+                continue;
+            }
+
+            s.position = hit.position;
+            s.normal = hit.normal;
+            s.albedo = attenuation;
+            s.valid = true;
+            return glm::vec3(0, 0, 0);
+        }
+        return glm::vec3(0, 0, 0);
+    }
+
+    // Light chosen by power, then a uniform point on it. pdf is per area, or just the choice for point lights.
+    LightSample sampleLight(float& pdf){
+        float pmf;
+        const LightList::Entry& entry = trace.lightList.entries[lightTable.sample(randomFloat(), pmf)];
+        LightSample sample;
+        if( entry.point ){
+            const Light& light = trace.lights[entry.index];
+            sample.position = light.position;
+            sample.emission = light.power;
+            sample.point = true;
+            pdf = pmf;
+        }else{
+            Object* emitter = trace.lightList.emitters[entry.index];
+            sample.position = emitter->emissionPoint(sample.normal);
+            sample.emission = materialTable[emitter->material].emit(Hit());
+            pdf = pmf / emitter->area();
+        }
+        return sample;
+    }
+
+    // Reflected radiance from the sample, without the shadow test. Point lights as in Trace::unshadowedPointLight.
+    glm::vec3 contribution(const Surface& s, const LightSample& sample) const {
+        glm::vec3 toLight = sample.position - s.position;
+        float dist2 = fmax(length2(toLight), eps);
+        glm::vec3 dir = toLight / sqrtf(dist2);
+        float cosSurface = glm::dot(s.normal, dir);
+        if( cosSurface <= 0 ) return glm::vec3(0, 0, 0);
+        if( sample.point ) return s.albedo * cosSurface * sample.emission / (4 * glm::pi<float>() * dist2);
+
+        float cosLight = -glm::dot(sample.normal, dir);
+        if( cosLight <= 0 ) return glm::vec3(0, 0, 0);
+        return s.albedo / glm::pi<float>() * sample.emission * cosSurface * cosLight / dist2;
+    }
+
+    // Reservoirs are only shared between pixels that see about the same surface.
+    bool similar(const Surface& a, const Surface& b) const {
+        return a.valid && b.valid && glm::dot(a.normal, b.normal) >= 0.9f && fabs(a.depth - b.depth) <= 0.1f * a.depth;
+    }
+
+    float targetPdf(const Surface& s, const LightSample& sample) const {
+        return luminance(contribution(s, sample));
+    }
+
+    // Streams the other reservoir in as one candidate standing for all of its candidates,
+    // its sample reweighted for this surface.
+    void combine(Reservoir& r, const Reservoir& other, const Surface& s){
+        float M = r.M;
+        r.update(other.sample, targetPdf(s, other.sample) * other.W * other.M);
+        r.M = M + other.M;
+    }
+
+    void finish(Reservoir& r, const Surface& s){
+        float p = targetPdf(s, r.sample);
+        r.W = p > 0 && r.M > 0 ? r.weightSum / (r.M * p) : 0;
+    }
+
+    bool visible(const Surface& s, const LightSample& sample){
+        glm::vec3 toLight = sample.position - s.position;
+        float dist = glm::length(toLight);
+        Ray shadowRay(s.position + s.normal * eps, toLight);
+        // Stop just before the light, it would occlude itself.
+        return !trace.bvh.occluded(shadowRay, dist * 0.999f);
+    }
+};
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Object.h"
+#include "Material.h"
+
+// The part of the scene the windows edit. The windows change a copy of it during a frame, and Trace::applySettings
+// takes the copy in before the next one, so no frame renders half of an edit, and the renderers see which
+// version they added up their samples for.
+struct SceneSettings {
+    glm::vec3 eye, lookat;
+    float fov = 1, aperture = 0;
+    glm::vec3 backGroundColor1, backGroundColor2;
+    float environmentIntensity = 1;
+    std::vector<Light> lights;
+    std::vector<Material> materials;
+
+    // Changes other than the camera: the lighting differs, and what was rendered with it.
+    bool lightingDiffers(const SceneSettings& other) const {
+        if( backGroundColor1 != other.backGroundColor1 || backGroundColor2 != other.backGroundColor2 ||
+            environmentIntensity != other.environmentIntensity ) return true;
+        if( lights.size() != other.lights.size() || materials.size() != other.materials.size() ) return true;
+        for( size_t i = 0; i < lights.size(); ++i )
+            if( lights[i].position != other.lights[i].position || lights[i].power != other.lights[i].power ) return true;
+        for( size_t i = 0; i < materials.size(); ++i )
+            if( !materials[i].sameAs(other.materials[i]) ) return true;
+        return false;
+    }
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <glm/ext/scalar_constants.hpp>
+#include <cmath>
+
+// Rectangle seen from a point, for sampling it uniformly by solid angle.
+// Urena, Fajardo, King: An Area-Preserving Parametrization for Spherical Rectangles (2013).
+struct SphericalRectangle {
+    glm::vec3 origin;
+    glm::vec3 x, y, z; // Local frame, z faces away from the rectangle.
+    float z0, x0, y0, x1, y1;
+    float b0, b1, k;
+    float solidAngle = 0;
+
+    // Rectangle with corner s and perpendicular edges ex and ey, seen from o.
+    SphericalRectangle(const glm::vec3& s, const glm::vec3& ex, const glm::vec3& ey, const glm::vec3& o){
+        origin = o;
+        float exl = glm::length(ex), eyl = glm::length(ey);
+        x = ex / exl;
+        y = ey / eyl;
+        z = glm::cross(x, y);
+
+        glm::vec3 d = s - o;
+        z0 = glm::dot(d, z);
+        if( z0 > 0 ){ z = -z; z0 = -z0; }
+        x0 = glm::dot(d, x);
+        y0 = glm::dot(d, y);
+        x1 = x0 + exl;
+        y1 = y0 + eyl;
+
+        // Normals of the planes through the origin and the edges.
+        glm::vec3 v00(x0, y0, z0), v01(x0, y1, z0), v10(x1, y0, z0), v11(x1, y1, z0);
+        glm::vec3 n0 = glm::normalize(glm::cross(v00, v10));
+        glm::vec3 n1 = glm::normalize(glm::cross(v10, v11));
+        glm::vec3 n2 = glm::normalize(glm::cross(v11, v01));
+        glm::vec3 n3 = glm::normalize(glm::cross(v01, v00));
+
+        // Internal angles of the spherical rectangle.
+        float g0 = acosf(glm::clamp(-glm::dot(n0, n1), -1.0f, 1.0f));
+        float g1 = acosf(glm::clamp(-glm::dot(n1, n2), -1.0f, 1.0f));
+        float g2 = acosf(glm::clamp(-glm::dot(n2, n3), -1.0f, 1.0f));
+        float g3 = acosf(glm::clamp(-glm::dot(n3, n0), -1.0f, 1.0f));
+
+        b0 = n0.z;
+        b1 = n2.z;
+        k = 2 * glm::pi<float>() - g2 - g3;
+        solidAngle = g0 + g1 - k;
+        if( !(solidAngle > 0) ) solidAngle = 0; // Origin in the plane of the rectangle, or NaN.
+    }
+
+    // Too small to sample accurately in float, area sampling is used instead.
+    bool valid() const { return solidAngle > 1e-4f; }
+
+    // Uniformly distributed point on the rectangle, u and v in [0, 1).
+    glm::vec3 sample(float u, float v) const {
+        float au = u * solidAngle + k;
+        float fu = (cosf(au) * b0 - b1) / sinf(au);
+        float cu = 1.0f / sqrtf(fu * fu + b0 * b0) * (fu > 0 ? 1.0f : -1.0f);
+        cu = glm::clamp(cu, -1.0f, 1.0f);
+
+        float xu = -(cu * z0) / sqrtf(fmax(1 - cu * cu, 1e-12f));
+        xu = glm::clamp(xu, x0, x1);
+
+        float d = sqrtf(xu * xu + z0 * z0);
+        float h0 = y0 / sqrtf(d * d + y0 * y0);
+        float h1 = y1 / sqrtf(d * d + y1 * y1);
+        float hv = h0 + v * (h1 - h0);
+        float hv2 = hv * hv;
+        float yv = (hv2 < 1 - 1e-6f) ? (hv * d) / sqrtf(1 - hv2) : y1;
+
+        return origin + xu * x + yv * y + z0 * z;
+    }
+
+    float pdf() const { return 1.0f / solidAngle; }
+};
@@ -3,34 +3,172 @@
 
 #include <GL/glew.h>
 #include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 
 #include <glm/glm.hpp>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TEXTURE_F16C 1
+#include <immintrin.h>
+#endif
+
+// Float to half float, rounding to nearest even. Too large values become infinity.
+inline uint16_t floatToHalf(float value){
+    uint32_t f;
+    memcpy(&f, &value, sizeof(f));
+    uint32_t sign = f & 0x80000000u;
+    f ^= sign;
+    uint16_t half;
+    if( f >= 0x47800000u ) half = f > 0x7F800000u ? 0x7E00 : 0x7C00; // NaN, or too large.
+    else if( f < 0x38800000u ){
+        // Denormal: adding 0.5 puts the bits at the bottom of the mantissa, rounded by the float add.
+        float shifted;
+        memcpy(&shifted, &f, sizeof(f));
+        shifted += 0.5f;
+        uint32_t bits;
+        memcpy(&bits, &shifted, sizeof(bits));
+        half = bits - 0x3F000000u;
+    }else{
+        uint32_t odd = (f >> 13) & 1;
+        f += ((uint32_t)(15 - 127) << 23) + 0xFFF + odd;
+        half = f >> 13;
+    }
+    return half | (sign >> 16);
+}
+
+inline float halfToFloat(uint16_t half){
+    uint32_t bits = (uint32_t)(half & 0x7FFF) << 13;
+    bool special = (half & 0x7C00) == 0x7C00; // Infinity or NaN.
+    if( special ) bits |= 0x7F800000u;
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    if( !special ) value *= 5.192296858534828e33f; // 2^112, from the half exponent bias to the float one, denormals too.
+    return half & 0x8000 ? -value : value;
+}
+
+#ifdef TEXTURE_F16C
+// Eight at a time with the F16C instructions, only this function is compiled for them.
+__attribute__((target("avx,f16c"))) inline void floatsToHalvesF16C(const float* in, uint16_t* out, size_t count){
+    size_t i = 0;
+    for( ; i + 8 <= count; i += 8 )
+        _mm_storeu_si128((__m128i*)(out + i), _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT));
+    for( ; i < count; ++i ) out[i] = floatToHalf(in[i]);
+}
+#endif
+
+// With F16C where the processor has it.
+inline void floatsToHalves(const float* in, uint16_t* out, size_t count){
+#ifdef TEXTURE_F16C
+    static const bool f16c = __builtin_cpu_supports("f16c");
+    if( f16c ){
+        floatsToHalvesF16C(in, out, count);
+        return;
+    }
+#endif
+    for( size_t i = 0; i < count; ++i ) out[i] = floatToHalf(in[i]);
+}
+
+// Display texture, half floats on the GPU (the shader does the gamma, 8 bits would band in the dark).
+// Rectangles are converted into pixel buffer objects and copied from there, so glTexSubImage2D returns
+// before the GPU has the pixels. The buffers are used in turn, each has a fence and is only written
+// again when the GPU is done with it. They stay mapped where the driver has buffer storage (GL 4.4).
 class Texture{
 public:
     unsigned int id = 0;
-    void create(int width, int height, const std::vector<glm::vec4>& image, int sampling = GL_LINEAR) {
+    int width = 0, height = 0;
+
+    void create(int pwidth, int pheight, const std::vector<glm::vec4>& image, int sampling = GL_LINEAR) {
             if (id == 0) glGenTextures(1, &id);
-            glBindTexture(GL_TEXTURE_2D, id);    
+            glBindTexture(GL_TEXTURE_2D, id);
+            width = pwidth;
+            height = pheight;
 
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_FLOAT, &image[0]); 
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, height, 0, GL_RGBA, GL_FLOAT, &image[0]);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, sampling);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, sampling);
         }
 
     ~Texture() {
 		if (id > 0) glDeleteTextures(1, &id);
+        deleteBuffers();
 	}
 
 	void setPixel( int X, int Y, const std::vector<glm::vec4> &pixels ){
-        glBindTexture(GL_TEXTURE_2D, id);
-        glTexSubImage2D(GL_TEXTURE_2D, 0, X, Y, 1, 1, GL_RGBA, GL_FLOAT, &pixels[0]);
+        setRect(X, Y, 1, 1, &pixels[0]);
     }
 
     void setRect( int X, int Y, int w, int h, const std::vector<glm::vec4> &pixels) {
+        setRect(X, Y, w, h, &pixels[0]);
+    }
+
+    // w x h pixels, rows one after the other.
+    void setRect( int X, int Y, int w, int h, const glm::vec4* pixels) {
+        size_t bytes = (size_t)w * h * 4 * sizeof(uint16_t);
+        // Room for the whole texture, so a buffer fits any rectangle after the first.
+        if( bytes > bufferBytes ) makeBuffers(std::max(bytes, (size_t)width * height * 4 * sizeof(uint16_t)));
+
+        int i = next;
+        next = (next + 1) % ringSize;
+        if( fences[i] ){
+            while( glClientWaitSync(fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED );
+            glDeleteSync(fences[i]);
+            fences[i] = 0;
+        }
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[i]);
+        void* target = persistent ? mapped[i] : glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        floatsToHalves(&pixels[0].x, (uint16_t*)target, (size_t)w * h * 4);
+        if( !persistent ) glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
         glBindTexture(GL_TEXTURE_2D, id);
-        glTexSubImage2D(GL_TEXTURE_2D, 0, X, Y, w, h, GL_RGBA, GL_FLOAT, &pixels[0]);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, X, Y, w, h, GL_RGBA, GL_HALF_FLOAT, (void*)0);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        fences[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+private:
+    static const int ringSize = 3;
+    unsigned int buffers[ringSize] = {};
+    void* mapped[ringSize] = {};
+    GLsync fences[ringSize] = {};
+    size_t bufferBytes = 0;
+    int next = 0;
+    bool persistent = false;
+
+    void makeBuffers(size_t bytes){
+        deleteBuffers();
+        persistent = GLEW_ARB_buffer_storage;
+        glGenBuffers(ringSize, buffers);
+        for( int i = 0; i < ringSize; ++i ) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[i]);
+            if( persistent ){
+                GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+                glBufferStorage(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, flags);
+                mapped[i] = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, flags);
+            }else glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        bufferBytes = bytes;
+        next = 0;
+    }
+
+    void deleteBuffers(){
+        if( bufferBytes == 0 ) return;
+        for( int i = 0; i < ringSize; ++i ) {
+            if( fences[i] ) glDeleteSync(fences[i]);
+            fences[i] = 0;
+            if( persistent ){
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[i]);
+                glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            }
+            mapped[i] = nullptr;
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glDeleteBuffers(ringSize, buffers);
+        bufferBytes = 0;
     }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+// Image textures, loaded lazily in square tiles into a cache with a memory budget.
+// Only the header of a file is read when it is added. Tiles of the full resolution level are read
+// from the file when first used, tiles of the smaller MIP levels are filtered from the level above
+// (through the cache too), so a texture never has to be in memory completely.
+// The least recently used tiles are evicted when the budget is exceeded.
+// Each thread keeps a few tiles in a small lock free micro cache, the shared cache is locked only on a miss there.
+// Supported files: binary PPM (P6, sRGB) and PFM (PF, linear).
+class TextureCache {
+public:
+    static const int tileSize = 32;
+
+    struct Tile {
+        glm::vec3 texels[tileSize * tileSize];
+    };
+
+    size_t memoryBudget = 256u << 20; // Bytes.
+    size_t memoryUsed = 0;
+    long long tileLoads = 0, evictions = 0;
+
+    // Index of the texture from the file, or -1 if it can't be read.
+    int add( const std::string& path ){
+        for( int i = 0; i < textures.size(); ++i )
+            if( textures[i]->path == path ) return i;
+
+        std::unique_ptr<TextureFile> texture(new TextureFile);
+        texture->path = path;
+        if( !readHeader(*texture) ){
+            std::cout << "Can't load texture: " << path << std::endl;
+            return -1;
+        }
+        for( int w = texture->width, h = texture->height; ; w = std::max(1, w / 2), h = std::max(1, h / 2) ) {
+            texture->levelSizes.push_back(glm::ivec2(w, h));
+            if( w == 1 && h == 1 ) break;
+        }
+        textures.push_back(std::move(texture));
+        return textures.size() - 1;
+    }
+
+    int levels( int texture ) const { return textures[texture]->levelSizes.size(); }
+
+    // Trilinear lookup, the MIP level is chosen so a texel is about as wide as the footprint (in uv units).
+    glm::vec3 sample( int texture, glm::vec2 uv, float footprint ){
+        const TextureFile& file = *textures[texture];
+        float level = log2f(fmax(footprint * std::max(file.width, file.height), 1e-8f));
+        level = glm::clamp(level, 0.0f, (float)file.levelSizes.size() - 1);
+
+        int level0 = (int)level;
+        float f = level - level0;
+        glm::vec3 color = bilinear(texture, level0, uv);
+        if( f > 0 && level0 + 1 < file.levelSizes.size() )
+            color = color * (1 - f) + bilinear(texture, level0 + 1, uv) * f;
+        return color;
+    }
+
+    glm::vec3 bilinear( int texture, int level, glm::vec2 uv ){
+        glm::ivec2 size = textures[texture]->levelSizes[level];
+        float x = uv.x * size.x - 0.5f;
+        float y = (1 - uv.y) * size.y - 0.5f; // Image rows go from the top.
+        int x0 = (int)floorf(x), y0 = (int)floorf(y);
+        float fx = x - x0, fy = y - y0;
+        return (texel(texture, level, x0, y0) * (1 - fx) + texel(texture, level, x0 + 1, y0) * fx) * (1 - fy) +
+               (texel(texture, level, x0, y0 + 1) * (1 - fx) + texel(texture, level, x0 + 1, y0 + 1) * fx) * fy;
+    }
+
+    // Texel with repeat wrapping.
+    glm::vec3 texel( int texture, int level, int x, int y ){
+        glm::ivec2 size = textures[texture]->levelSizes[level];
+        x %= size.x; if( x < 0 ) x += size.x;
+        y %= size.y; if( y < 0 ) y += size.y;
+
+        uint64_t key = tileKey(texture, level, x / tileSize, y / tileSize);
+        MicroCacheEntry& entry = microCache[(key ^ key >> 17) % microCacheSize];
+        if( !entry.tile || entry.key != key || entry.owner != this ){
+            entry.tile = tile(key);
+            entry.key = key;
+            entry.owner = this;
+        }
+        return entry.tile->texels[(y % tileSize) * tileSize + x % tileSize];
+    }
+
+    // Evicts tiles until the budget is kept.
+    void trim(){
+        std::lock_guard<std::mutex> lock(mutex);
+        evict();
+    }
+
+private:
+    struct TextureFile {
+        std::string path;
+        int width = 0, height = 0;
+        bool floats = false; // PFM.
+        bool littleEndian = true;
+        int channels = 3;
+        std::streamoff dataOffset = 0;
+        std::vector<glm::ivec2> levelSizes;
+        std::mutex fileMutex;
+        std::ifstream file;
+    };
+
+    struct CacheEntry {
+        std::shared_ptr<const Tile> tile;
+        std::list<uint64_t>::iterator lruPosition;
+    };
+
+    // Tiles stay alive while a micro cache holds them, even if evicted from the shared cache,
+    // so memory can go over the budget by at most microCacheSize tiles per thread.
+    struct MicroCacheEntry {
+        const TextureCache* owner = nullptr;
+        uint64_t key = 0;
+        std::shared_ptr<const Tile> tile;
+    };
+    static const int microCacheSize = 16;
+    static thread_local MicroCacheEntry microCache[microCacheSize];
+
+    std::vector<std::unique_ptr<TextureFile>> textures;
+    std::unordered_map<uint64_t, CacheEntry> tiles;
+    std::list<uint64_t> lru; // Most recently used first.
+    std::mutex mutex;
+
+    static uint64_t tileKey( int texture, int level, int tx, int ty ){
+        return (uint64_t)texture << 48 | (uint64_t)level << 42 | (uint64_t)ty << 21 | (uint64_t)tx;
+    }
+
+    std::shared_ptr<const Tile> tile( uint64_t key ){
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = tiles.find(key);
+            if( it != tiles.end() ){
+                lru.splice(lru.begin(), lru, it->second.lruPosition);
+                return it->second.tile;
+            }
+        }
+
+        // Loaded without holding the lock, other threads can use the cache meanwhile.
+        std::shared_ptr<const Tile> loaded = loadTile(key >> 48, (key >> 42) & 63, key & 0x1FFFFF, (key >> 21) & 0x1FFFFF);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = tiles.find(key);
+        if( it != tiles.end() ) return it->second.tile; // Another thread was faster.
+        lru.push_front(key);
+        tiles[key] = {loaded, lru.begin()};
+        memoryUsed += sizeof(Tile);
+        tileLoads++;
+        evict();
+        return loaded;
+    }
+
+    void evict(){
+        while( memoryUsed > memoryBudget && lru.size() > 1 ) {
+            tiles.erase(lru.back());
+            lru.pop_back();
+            memoryUsed -= sizeof(Tile);
+            evictions++;
+        }
+    }
+
+    std::shared_ptr<const Tile> loadTile( int texture, int level, int tx, int ty ){
+        std::shared_ptr<Tile> tile(new Tile);
+        glm::ivec2 size = textures[texture]->levelSizes[level];
+        int x0 = tx * tileSize, y0 = ty * tileSize;
+        int w = glm::min(tileSize, size.x - x0), h = glm::min(tileSize, size.y - y0); // By value, std::min would need a definition of tileSize.
+
+        if( level == 0 ) readRows(*textures[texture], x0, y0, w, h, *tile);
+        else {
+            // Box filter of the level above. The (up to 4) parent tiles are held here while filtering,
+            // so they can't be evicted halfway, even with a tiny budget.
+            glm::ivec2 parentSize = textures[texture]->levelSizes[level - 1];
+            std::shared_ptr<const Tile> parents[2][2];
+            for( int j = 0; j < 2; ++j )
+                for( int i = 0; i < 2; ++i )
+                    if( (2 * tx + i) * tileSize < parentSize.x && (2 * ty + j) * tileSize < parentSize.y )
+                        parents[j][i] = this->tile(tileKey(texture, level - 1, 2 * tx + i, 2 * ty + j));
+
+            auto parentTexel = [&](int px, int py){
+                px = std::min(px, parentSize.x - 1);
+                py = std::min(py, parentSize.y - 1);
+                const Tile& parent = *parents[py / tileSize - 2 * ty][px / tileSize - 2 * tx];
+                return parent.texels[(py % tileSize) * tileSize + px % tileSize];
+            };
+            for( int y = 0; y < h; ++y )
+                for( int x = 0; x < w; ++x ) {
+                    int px = 2 * (x0 + x), py = 2 * (y0 + y);
+                    tile->texels[y * tileSize + x] = 0.25f * (parentTexel(px, py) + parentTexel(px + 1, py) +
+                                                              parentTexel(px, py + 1) + parentTexel(px + 1, py + 1));
+                }
+        }
+        return tile;
+    }
+
+    static float srgbToLinear( float c ){
+        return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+    }
+
+    void readRows( TextureFile& texture, int x0, int y0, int w, int h, Tile& tile ){
+        int texelBytes = texture.channels * (texture.floats ? 4 : 1);
+        std::vector<unsigned char> row(w * texelBytes);
+
+        std::lock_guard<std::mutex> lock(texture.fileMutex);
+        for( int y = 0; y < h; ++y ) {
+            // PFM rows are stored from the bottom.
+            int fileRow = texture.floats ? texture.height - 1 - (y0 + y) : y0 + y;
+            texture.file.clear();
+            texture.file.seekg(texture.dataOffset + ((std::streamoff)fileRow * texture.width + x0) * texelBytes);
+            texture.file.read((char*)row.data(), row.size());
+
+            for( int x = 0; x < w; ++x ) {
+                glm::vec3 color;
+                for( int c = 0; c < 3; ++c ) {
+                    int channel = std::min(c, texture.channels - 1);
+                    const unsigned char* p = &row[x * texelBytes + channel * (texture.floats ? 4 : 1)];
+                    if( texture.floats ){
+                        unsigned char b[4] = {p[0], p[1], p[2], p[3]};
+                        if( !texture.littleEndian ){ std::swap(b[0], b[3]); std::swap(b[1], b[2]); }
+                        float v;
+                        memcpy(&v, b, 4);
+                        color[c] = v;
+                    } else color[c] = srgbToLinear(p[0] / 255.0f);
+                }
+                tile.texels[y * tileSize + x] = color;
+            }
+        }
+    }
+
+    bool readHeader( TextureFile& texture ){
+        texture.file.open(texture.path, std::ios::binary);
+        if( !texture.file ) return false;
+
+        std::string magic;
+        texture.file >> magic;
+        if( magic == "P6" ){
+            int maxValue;
+            texture.file >> texture.width >> texture.height >> maxValue;
+            if( maxValue > 255 ) return false;
+        }else if( magic == "PF" || magic == "Pf" ){
+            float scale;
+            texture.file >> texture.width >> texture.height >> scale;
+            texture.floats = true;
+            texture.channels = magic == "PF" ? 3 : 1;
+            texture.littleEndian = scale < 0;
+        }else return false;
+
+        texture.file.get(); // Single whitespace before the data.
+        texture.dataOffset = texture.file.tellg();
+        return texture.file && texture.width > 0 && texture.height > 0;
+    }
+};
+
+thread_local TextureCache::MicroCacheEntry TextureCache::microCache[TextureCache::microCacheSize];
+
+TextureCache textureCache;
@@ -29,8 +29,10 @@ public:
         glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
     }
 
+    // The texture is only made again when the size changes.
     void setTexture( int width, int height, std::vector<glm::vec4>& image ){
-        texture.create( width, height, image );
+        if( texture.id != 0 && width == texture.width && height == texture.height ) texture.setRect( 0, 0, width, height, image );
+        else texture.create( width, height, image );
     }
 
     void draw(){
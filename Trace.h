@@ -5,6 +5,10 @@
 #include <SDL2/SDL.h>
 #include <random>
 #include <map>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <memory>
 
 
 #include "Object.h"
@@ -17,13 +21,32 @@
 
 #include "AABB.h"
 #include "BVHnode.h"
+#include "LightBVH.h"
+#include "LightList.h"
+#include "MeshLight.h"
+#include "IrradianceCache.h"
+#include "PolygonLight.h"
+#include "HitCache.h"
+#include "SceneSettings.h"
+#include "PathRecord.h"
 
 
+// Values of Trace::traceFunctionType, in the order of the Tracefunc slider and of the --mode names.
+enum TraceMode { MODE_PATH, MODE_DIRECT, MODE_SPPM, MODE_MLT, MODE_RESTIR, MODE_AO, MODE_NORMALS, MODE_DEPTH, MODE_OBJECT_IDS, MODE_COUNT };
+
 class Trace {
 public:
     BVHnode bvh;
     std::vector<Object*> objects;
     std::vector<Object*> emissiveList;
+    std::vector<Object*> meshLights; // Owned here, the triangles are in objects.
+    LightList lightList;
+    LightBVH lightBVH;
+    std::vector<Object*> polygonLights; // Flat emitters, sorted by address, for analytic lighting.
+    EnvironmentMap environment; // Background and light when loaded, otherwise the gradient is used.
+    PathGuide pathGuide;
+    IrradianceCache irradianceCache;
+    PrimaryHitCache hitCache;
     std::vector<Light> lights;
     Camera camera;
     DirectionalLight dLight = {{0.2, 0.2, 0.2},
@@ -32,7 +55,7 @@ public:
                                {1, 1, 1}};
 
 
-    std::map<std::string, Material*> materials;
+    std::map<std::string, MaterialId> materials; // Indices into materialTable, by name.
 
     glm::vec3 backGroundColor1 = glm::vec3(0, 0, 0);
     glm::vec3 backGroundColor2 = glm::vec3(0, 0, 0);
@@ -41,7 +64,22 @@ public:
     int samples = 1;
     int maxDepth = 5;
 
-    int traceFunctionType = 0;
+    int traceFunctionType = MODE_PATH; // A TraceMode, kept as an int for the slider.
+    bool packetTracing = true; // Trace camera rays in 8x8 packets when there is no aperture.
+    int lightSelectionType = 0; // 0: uniform, 1: light BVH, 2: by power (alias table).
+    int lightSamples = 1; // Point light shadow rays per hit, when choosing by power.
+    bool pathGuiding = false; // Learn where light comes from during the render, and sample it at diffuse hits.
+    int guidingPasses = 256; // Passes of the render the guide learns from, in iterations of 1, 2, 4, ...
+    int irradianceCaching = 0; // Depth of the diffuse hits that use the irradiance cache, 0: off, 1: first hit (preview), 2: after the first bounce.
+    bool analyticLighting = false; // Light from flat emitters in closed form at diffuse hits, shadows from a few rays.
+    int analyticShadowRays = 4; // Per diffuse hit, for the ratio estimate of the shadows.
+    float aoDistance = 0.5; // Reach of the ambient occlusion rays.
+    int aoSamples = 4; // Ambient occlusion rays per camera ray.
+    float depthRange = 5; // Distance shown as white in the depth mode.
+    bool hitCaching = false; // Keep the first hits of camera rays for the next samples and renders (pinhole camera).
+    int sceneVersion = 0; // Counts geometry changes, they invalidate the hit cache.
+    int settingsVersion = 0; // Counts edits of lights, materials and the background (applySettings).
+    uint64_t editedMaterials = 0; // Bits of the materials of the last edit if only their albedos changed, otherwise 0.
     const float eps = 0.0001f;
 
     float renderTime = 0.0;
@@ -50,16 +88,45 @@ public:
     int ry = 0;
     std::vector<glm::vec4> pixels;
     unsigned int startTicksLoop = 0;
+    float frameBudget = 33; // Milliseconds of tracing per frame in the render loop.
+    float settleTime = 0.2; // Seconds the camera must be still before the render loop goes to full resolution.
+    int previewScale = 1; // Of the render loop, 8 or 4 for previews, 1 for the passes at full resolution.
+    int passes = 0; // Finished passes of the render loop.
+    int segment = 0; // Next row segment of 8 pixels in the pass.
+    double segmentCost = 0; // Running estimate of the seconds a segment takes.
+    bool reprojection = true; // Keep the samples of the render loop over small camera moves, where the surface stays.
+    float reprojectionHistory = 16; // Samples a reprojected pixel keeps at most, so it follows what changed.
+    bool pathReplay = false; // Record the paths of the render loop's first passes, albedo edits are evaluated from them.
+    int replaySamples = 2; // Passes recorded.
+    PathRecords pathRecords;
+    bool recordsValid = false; // The records are of the samples in the history.
+    // Samples of a pixel in the render loop, and the surface seen through its center, for reprojection.
+    struct PixelHistory {
+        glm::vec4 sum = glm::vec4(0, 0, 0, 0); // The sample count in w.
+        glm::vec3 position;
+        int object = -1; // objectId, -1 for the background and for mirrors and glass, which look different from elsewhere.
+        bool checked = false; // Traced with the current camera.
+    };
+    std::vector<PixelHistory> history, movedHistory;
+    glm::vec3 movedEye, movedLookat; // Camera when the refinement was started.
+    float movedFov = 0, movedAperture = 0;
+    unsigned int moveTicks = 0;
+    int loopScene = -1, loopSettings = -1; // Versions the render loop's samples are for.
 
     std::map<string, void (Trace::*)()> initFunctions;
 
     // ======== Add box and Rectangle ========
-    void addRectangle( glm::vec3 p1, glm::vec3 p2, glm::vec3 p3, glm::vec3 p4, Material* mat){
-        objects.push_back( new Triangle(  p1, p3, p2, mat ) );
-        objects.push_back( new Triangle(  p4, p2, p3, mat ) );
+    // Texture coordinates go from (0, 0) at p1 to uvScale at p4.
+    void addRectangle( glm::vec3 p1, glm::vec3 p2, glm::vec3 p3, glm::vec3 p4, MaterialId mat, glm::vec2 uvScale = glm::vec2(1, 1)){
+        Triangle* tri1 = new Triangle(  p1, p3, p2, mat );
+        Triangle* tri2 = new Triangle(  p4, p2, p3, mat );
+        tri1->setUVs( glm::vec2(0, 0), glm::vec2(0, uvScale.y), glm::vec2(uvScale.x, 0) );
+        tri2->setUVs( uvScale, glm::vec2(uvScale.x, 0), glm::vec2(0, uvScale.y) );
+        objects.push_back( tri1 );
+        objects.push_back( tri2 );
     }
 
-    void addCube( glm::vec3 p, glm::vec3 s, Material* mat ){        
+    void addCube( glm::vec3 p, glm::vec3 s, MaterialId mat ){        
         addRectangle( p, p + glm::vec3(0, s.y, 0), p + glm::vec3(0, 0, s.z), p + glm::vec3(0, s.y, s.z), mat );
         addRectangle( p, p + glm::vec3(0, 0, s.z), p + glm::vec3(s.x, 0, 0), p + glm::vec3(s.x, 0, s.z), mat );
         addRectangle( p, p + glm::vec3(s.x, 0, 0), p + glm::vec3(0, s.y, 0), p + glm::vec3(s.x, s.y, 0), mat );
@@ -72,22 +139,25 @@ public:
     void resize( int pwidth, int pheight ){
         width = pwidth; height = pheight;
         camera.init( width, height );
-        pixels.resize(width);
+        pixels.resize(width * height);
     }
 
     void initMaterials(){
-        materials["green"] = new DiffuseMaterial( glm::vec3( 0.12, 0.45, 0.15 ));
-        materials["red"] = new DiffuseMaterial( glm::vec3( 0.65, 0.05, 0.05 ));
-        materials["white"] = new DiffuseMaterial( glm::vec3( 0.73, 0.73, 0.73 ));
-        materials["emissive"] = new EmissiveMaterial(glm::vec3(15, 15, 15));
-        materials["transparent"] = new TransparentMaterial( 1.5 );
-        materials["mirror"] = new MirrorMaterial( glm::vec3(0.7, 0.7, 0.7) );
-        materials["yellow"] = new DiffuseMaterial(glm::vec3( 0.6, 0.6, 0.2));
-        materials["blue"] = new DiffuseMaterial( glm::vec3( 0.2, 0.1, 0.6 ));
-        materials["dark"] = new DiffuseMaterial( glm::vec3(0.2, 0.2, 0.2));
-        materials["pinkMirror"] = new MirrorMaterial( glm::vec3( 235/255.0, 170/255.0, 230/255.0), 0.3);
-        materials["pink"] = new DiffuseMaterial( glm::vec3( 235/255.0, 170/255.0, 230/255.0));
-        materials["skyBlue"] = new DiffuseMaterial( glm::vec3( 168/255.0, 204/255.0, 244/255.0 ));
+        materials["green"] = materialTable.add("green", DiffuseMaterial( glm::vec3( 0.12, 0.45, 0.15 )));
+        materials["red"] = materialTable.add("red", DiffuseMaterial( glm::vec3( 0.65, 0.05, 0.05 )));
+        materials["white"] = materialTable.add("white", DiffuseMaterial( glm::vec3( 0.73, 0.73, 0.73 )));
+        materials["emissive"] = materialTable.add("emissive", EmissiveMaterial(glm::vec3(15, 15, 15)));
+        materials["transparent"] = materialTable.add("transparent", TransparentMaterial( 1.5 ));
+        materials["mirror"] = materialTable.add("mirror", MirrorMaterial( glm::vec3(0.7, 0.7, 0.7) ));
+        materials["yellow"] = materialTable.add("yellow", DiffuseMaterial(glm::vec3( 0.6, 0.6, 0.2)));
+        materials["blue"] = materialTable.add("blue", DiffuseMaterial( glm::vec3( 0.2, 0.1, 0.6 )));
+        materials["dark"] = materialTable.add("dark", DiffuseMaterial( glm::vec3(0.2, 0.2, 0.2)));
+        materials["pinkMirror"] = materialTable.add("pinkMirror", MirrorMaterial( glm::vec3( 235/255.0, 170/255.0, 230/255.0), 0.3));
+        materials["pink"] = materialTable.add("pink", DiffuseMaterial( glm::vec3( 235/255.0, 170/255.0, 230/255.0)));
+        materials["skyBlue"] = materialTable.add("skyBlue", DiffuseMaterial( glm::vec3( 168/255.0, 204/255.0, 244/255.0 )));
+        materials["orangeLight"] = materialTable.add("orangeLight", EmissiveMaterial(glm::vec3(4, 2, 0.5)));
+        materials["hiddenLight"] = materialTable.add("hiddenLight", EmissiveMaterial(glm::vec3(300, 300, 300))); // Lights a room from behind a gap.
+        materials["checker"] = materialTable.add("checker", TexturedMaterial("textures/checker.ppm"));
     }
 
     // ============ Build scene ============
@@ -121,7 +191,51 @@ public:
         emissiveList.push_back(lightFront);
     }
 
-    void initCornellBoxSides(){
+    // Lit only by the environment map, with a sun in it.
+    void initSkyDragon(){
+        float fov = 45 * glm::pi<float>() / 180;
+        camera.set( { 3.5, 0, 1 }, { 0, 0, 0.5 }, fov );
+
+        addRectangle(glm::vec3(-10, -10, 0), glm::vec3(-10, 10, 0), glm::vec3(10, -10, 0), glm::vec3(10, 10, 0), materials["white"]);
+
+        Model dragon;
+        dragon.loadOBJ("dragon.obj");
+        dragon.add(materials["yellow"], objects, glm::vec3(0, 0, 0), glm::vec3(0.4), 3.14/2, 3.14/2);
+        objects.push_back( new Sphere( glm::vec3(0.3, 1.3, 0.4), 0.4, materials["mirror"] ) );
+
+        environment.load("textures/sky.hdr");
+    }
+
+    // The light is above a false ceiling, facing up, closed in at the front. The room only gets light that
+    // bounces down through the gap at the back, hard for cosine sampling. The camera doesn't see the light above.
+    void initCornellBoxLightLeak(){
+        initCornellBoxWalls();
+        float s = 1.0;
+        float h = 1.6;
+        float gap = -0.5;
+        addRectangle(glm::vec3(gap, -s, h), glm::vec3(gap, s, h), glm::vec3(s, -s, h), glm::vec3(s, s, h), materials["white"]);
+        addRectangle(glm::vec3(s, -s, h), glm::vec3(s, s, h), glm::vec3(s, -s, s*2), glm::vec3(s, s, s*2), materials["white"]);
+
+        OrientedRectangle* light = new OrientedRectangle( glm::vec3(0.3, -0.2, h + 0.02), glm::vec3(0.4, 0, 0),
+                                                          glm::vec3(0, 0.4, 0), materials["hiddenLight"] );
+        objects.push_back(light);
+        emissiveList.push_back(light);
+
+        Model box;
+        box.loadBox(glm::vec3(-0.5, -0.5, 0), glm::vec3(1, 1, 1));
+        box.add(materials["white"], objects, glm::vec3(-0.3, -0.3, 0), glm::vec3(0.6, 0.6, 1.1), 0.0, 0.0, 0.3);
+    }
+
+    void initCornellBoxTextured(){
+        initCornellBoxSides();
+        // Tiled floor just above the white one, and a textured sphere.
+        float s = 0.99;
+        addRectangle(glm::vec3(-s, -s, 0.001 ), glm::vec3(-s, s, 0.001 ), glm::vec3(s, -s, 0.001), glm::vec3( s, s, 0.001),
+                     materials["checker"], glm::vec2(4, 4));
+        objects.push_back( new Sphere( glm::vec3(0.0, 0.0, 0.4), 0.4, materials["checker"] ) );
+    }
+
+    void initCornellBoxWalls(){
         float fov = 45 * glm::pi<float>() / 180;
         camera.set( { 3.4, 0, 1 }, { 0, 0, 1 }, fov );
 
@@ -137,7 +251,12 @@ public:
         // Red and Green rectangles.
         addRectangle(glm::vec3(-s, -s, 0 ), glm::vec3(s, -s, 0), glm::vec3(-s, -s, s*2), glm::vec3( s, -s, s*2), materials["red"]);
         addRectangle(glm::vec3(-s, s, 0 ), glm::vec3(s, s, 0), glm::vec3(-s, s, s*2), glm::vec3( s, s, s*2), materials["green"]);
+    }
+
+    void initCornellBoxSides(){
+        initCornellBoxWalls();
         // Light.
+        float s = 1.0;
         float l = 0.2;
         float add = -0.01;
         RectangleZ* cornellLight = new RectangleZ( glm::vec3(-l,-l,s*2+add), glm::vec3(l,l,s*2+add), materials["emissive"] );
@@ -145,6 +264,39 @@ public:
         emissiveList.push_back(cornellLight);
     }
 
+    void initCornellBoxManyLights(){
+        initCornellBoxSides();
+        // Grid of small panels below the ceiling.
+        int n = 12;
+        float s = 0.9;
+        float l = 0.02;
+        for( int i = 0; i < n; ++i )
+            for( int j = 0; j < n; ++j ){
+                glm::vec3 c( -s + 2 * s * (i + 0.5f) / n, -s + 2 * s * (j + 0.5f) / n, 1.95 );
+                RectangleZ* panel = new RectangleZ( c - glm::vec3(l, l, 0), c + glm::vec3(l, l, 0), materials["emissive"] );
+                objects.push_back(panel);
+                emissiveList.push_back(panel);
+            }
+        Model box;
+        box.loadBox(glm::vec3(-0.5, -0.5, 0), glm::vec3(1, 1, 1));
+        box.add(materials["white"], objects, glm::vec3(-0.3, -0.3, 0), glm::vec3(0.6, 0.6, 1.1), 0.0, 0.0, 0.3);
+    }
+
+    void initCornellBoxSphereLight(){
+        initCornellBoxSides();
+        Sphere* sphereLight = new Sphere( glm::vec3(0.2, -0.4, 0.5), 0.1, materials["emissive"] );
+        objects.push_back(sphereLight);
+        emissiveList.push_back(sphereLight);
+
+        // Tilted panel on the back wall, facing the box.
+        OrientedRectangle* panel = new OrientedRectangle( glm::vec3(-0.95, 0.3, 0.6), glm::vec3(0, 0.3, 0),
+                                                          glm::vec3(0.2, 0, 0.2), materials["emissive"] );
+        objects.push_back(panel);
+        emissiveList.push_back(panel);
+
+        objects.push_back( new Sphere( glm::vec3(0.0, 0.3, 0.3), 0.3, materials["white"] ) );
+    }
+
     void initCornellBoxDefault(){
         initCornellBoxSides();
         Model box;
@@ -175,6 +327,13 @@ public:
         panther.add(materials["yellow"], objects, glm::vec3(0, 0, 1), glm::vec3(0.6), 3.14/2, 2*3.14/4.0);
     }
 
+    void initCornellBoxEmissiveDragon(){
+        initCornellBoxSides();
+        Model dragon;
+        dragon.loadOBJ("dragon.obj");
+        dragon.add(materials["orangeLight"], objects, glm::vec3(0, 0.0, 0), glm::vec3(0.2), 3.14/2, 2*3.14/3);
+    }
+
     void initCornellBoxGlassDragon(){
         initCornellBoxSides();
         Model dragon;
@@ -210,15 +369,125 @@ public:
         lights.push_back({glm::vec3(10000, 10000, 10000), glm::vec3(-30, 0.0001, 30)});
     }
 
-    void makeBVH(){ bvh.build(objects, 0, objects.size()); }
+    void makeBVH(){
+        sceneVersion++;
+        numberObjects();
+        bvh.build(objects, 0, objects.size());
+        addMeshLights();
+        buildLights();
+    }
+
+    // Ids for the object ID mode, in scene order (the BVH reorders objects), the triangles of a model share one.
+    void numberObjects(){
+        std::map<int, int> modelIds;
+        int nextId = 0;
+        for( Object* object : objects ) {
+            Triangle* triangle = dynamic_cast<Triangle*>(object);
+            if( !triangle || triangle->meshId < 0 ) object->objectId = nextId++;
+            else if( modelIds.count(triangle->meshId) ) object->objectId = modelIds[triangle->meshId];
+            else object->objectId = modelIds[triangle->meshId] = nextId++;
+        }
+    }
+
+    // Group emissive triangles by mesh and material, and add them as area lights.
+    void addMeshLights(){
+        for( Object* meshLight : meshLights ) {
+            emissiveList.erase(std::remove(emissiveList.begin(), emissiveList.end(), meshLight), emissiveList.end());
+            delete meshLight;
+        }
+        meshLights.clear();
+
+        std::map<std::pair<int, MaterialId>, std::vector<Triangle*>> meshes;
+        for( Object* object : objects ) {
+            Triangle* triangle = dynamic_cast<Triangle*>(object);
+            if( triangle && materialTable[triangle->material].emissive() )
+                meshes[{triangle->meshId, triangle->material}].push_back(triangle);
+        }
+
+        for( auto& mesh : meshes ) {
+            MeshLight* meshLight = new MeshLight(mesh.second);
+            meshLights.push_back(meshLight);
+            emissiveList.push_back(meshLight);
+        }
+    }
+
+    // Has to be called again when the power of lights or emissive materials changes.
+    void buildLights(){
+        lightList.build(lights, emissiveList);
+        // Built from the list's emitters, so light indices match the emitter table.
+        lightBVH.build(lightList.emitters);
+
+        polygonLights.clear();
+        glm::vec3 corners[8];
+        for( Object* emitter : lightList.emitters )
+            if( emitter->polygon(corners) > 0 ) polygonLights.push_back(emitter);
+        std::sort(polygonLights.begin(), polygonLights.end());
+    }
+
+    SceneSettings settings() const {
+        SceneSettings current;
+        current.eye = camera.eye;
+        current.lookat = camera.lookat;
+        current.fov = camera.fov;
+        current.aperture = camera.aperture;
+        current.backGroundColor1 = backGroundColor1;
+        current.backGroundColor2 = backGroundColor2;
+        current.environmentIntensity = environment.intensity;
+        current.lights = lights;
+        current.materials = materialTable.materials;
+        return current;
+    }
+
+    // Takes in the edits of the windows, between frames. A change of the lighting is a new settingsVersion,
+    // renderers that add up samples start again then. Camera moves are left to them, the render loop
+    // reprojects small ones.
+    void applySettings(const SceneSettings& edits){
+        SceneSettings current = settings();
+        bool lightingChanged = edits.lightingDiffers(current);
+        // Changes of albedos alone, the render loop can replay its paths for them.
+        editedMaterials = 0;
+        SceneSettings albedosKept = edits;
+        for( int i = 0; i < (int)albedosKept.materials.size() && i < (int)current.materials.size(); ++i ) {
+            if( albedosKept.materials[i].albedo != current.materials[i].albedo ) editedMaterials |= materialBit(i);
+            albedosKept.materials[i].albedo = current.materials[i].albedo;
+        }
+        if( albedosKept.lightingDiffers(current) ) editedMaterials = 0;
+        camera.eye = edits.eye;
+        camera.lookat = edits.lookat;
+        camera.fov = edits.fov;
+        camera.aperture = edits.aperture;
+        camera.set();
+        if( !lightingChanged ) return;
+        backGroundColor1 = edits.backGroundColor1;
+        backGroundColor2 = edits.backGroundColor2;
+        environment.intensity = edits.environmentIntensity;
+        lights = edits.lights;
+        materialTable.materials = edits.materials;
+        buildLights();
+        settingsVersion++;
+    }
+
+    // One of initFunctions, in place of the current scene.
+    void loadScene(const std::string& name){
+        resetScene();
+        (this->*initFunctions[name])();
+        makeBVH();
+    }
 
     void resetScene(){
         bvh.destroy();
         for( int i = 0; i < objects.size(); ++i)
             delete objects[i];
         objects.clear();
+        for( int i = 0; i < meshLights.size(); ++i)
+            delete meshLights[i];
+        meshLights.clear();
         emissiveList.clear();
         lights.clear();
+        environment.clear();
+        pathGuide.clear();
+        irradianceCache.clear();
+        hitCache.clear();
     }
 
     void initScene(){
@@ -233,6 +502,12 @@ public:
         initFunctions["lit dragon"] = &Trace::initModel;
         initFunctions["direct lights"] = &Trace::initTest;
         initFunctions["cornell panther"] = &Trace::initCornellBoxPanther;
+        initFunctions["cornell many lights"] = &Trace::initCornellBoxManyLights;
+        initFunctions["cornell box emissive dragon"] = &Trace::initCornellBoxEmissiveDragon;
+        initFunctions["cornell sphere light"] = &Trace::initCornellBoxSphereLight;
+        initFunctions["cornell textured"] = &Trace::initCornellBoxTextured;
+        initFunctions["sky dragon"] = &Trace::initSkyDragon;
+        initFunctions["cornell light leak"] = &Trace::initCornellBoxLightLeak;
 
         initCornellBoxDefault();
 
@@ -241,30 +516,275 @@ public:
     // ============ Build scene ============
 
 
-    // Render row by row, updating the texture right away.
+    // Records are made again for each render, the scene may have changed.
+    void resetIrradianceCache(){
+        AABB box;
+        bvh.getAABB(box);
+        irradianceCache.init(box);
+    }
+
+    // The path guide starts learning again, from the passes of the next render.
+    void startPathGuide(){
+        if( !pathGuiding || traceFunctionType != MODE_PATH ){
+            pathGuide.clear();
+            return;
+        }
+        AABB box;
+        bvh.getAABB(box);
+        pathGuide.init(box);
+    }
+
+    // Progressive rendering. After the camera moves, one frame at 1/8 resolution and then frames at 1/4,
+    // until the camera has been still for settleTime. Then passes of one sample per pixel at full resolution
+    // are added up until there are samples of them. Passes go in row segments of 8 pixels, as many each frame
+    // as fit in frameBudget. The loop keeps watching the camera when it is done.
     void startRenderLoop(){
+        startPathGuide();
+        resetIrradianceCache();
+        prepareHitCache();
         rendering = true;
-        ry = 0;
+        segmentCost = 0;
+        pixels.assign(width * height, glm::vec4(0, 0, 0, 1));
+        restartRefinement();
         startTicksLoop = SDL_GetTicks();
     }
 
     void renderLoop(Texture &texture){
         if( !rendering ) return;
-        // Render one row:
-#pragma omp parallel for
-        for (int x = 0; x < width; x++) {
-            glm::vec3 color = getColor(x, ry);
-            pixels[x] = glm::vec4(color.x, color.y, color.z, 1.0f);
+        prepareHitCache(); // The camera may have been moved.
+        if( history.size() != (size_t)width * height ){ // Resized.
+            pixels.assign(width * height, glm::vec4(0, 0, 0, 1));
+            restartRefinement();
+        }
+        double frequency = SDL_GetPerformanceFrequency();
+        Uint64 frameStart = SDL_GetPerformanceCounter();
+        bool moved = camera.eye != movedEye || camera.lookat != movedLookat || camera.fov != movedFov || camera.aperture != movedAperture;
+        bool edited = sceneVersion != loopScene || settingsVersion != loopSettings;
+        if( !recordPaths() ) recordsValid = false;
+        // Albedo edits right after the last frame can be replayed, otherwise the samples are of another scene or lighting.
+        if( edited && !moved && recordsValid && previewScale == 1 && sceneVersion == loopScene &&
+            settingsVersion == loopSettings + 1 && editedMaterials ) replayPaths();
+        else if( edited ){
+            resetIrradianceCache();
+            startPathGuide();
+            restartRefinement();
+        }
+        else if( moved && !(previewScale == 1 && reproject()) ) restartRefinement();
+        moved = moved || edited;
+
+        if( previewScale > 1 ){
+            renderCoarse(previewScale);
+            texture.setRect( 0, 0, width, height, pixels );
+            // Finer while the camera stays, full resolution once it has settled.
+            previewScale = 4;
+            if( SDL_GetTicks() - moveTicks >= settleTime * 1000 ) previewScale = 1;
+            return;
+        }
+        if( passes >= samples ){
+            if( moved ) texture.setRect( 0, 0, width, height, pixels );
+            return;
         }
-        // Send rendered row to texture.
-        texture.setRect( 0, ry, width, 1, pixels );
 
-        ry++;
+        int segmentsPerRow = (width + 7) / 8, segmentCount = segmentsPerRow * height;
+        int firstRow = segment / segmentsPerRow;
+
+        // Half of the budget left at a time, by the cost estimate, so a wrong estimate (the next segments
+        // may be harder) can't overshoot much. At least one segment per frame, whatever it costs.
+        double budget = frameBudget / 1000.0, used = (SDL_GetPerformanceCounter() - frameStart) / frequency;
+        do {
+            int count = segmentCost > 0 ? int(0.5 * (budget - used) / segmentCost) : 1;
+            count = glm::clamp(count, 1, segmentCount - segment);
+            Uint64 start = SDL_GetPerformanceCounter();
+            renderSegments(segment, count);
+            double seconds = (SDL_GetPerformanceCounter() - start) / frequency;
+            segmentCost = segmentCost > 0 ? 0.7 * segmentCost + 0.3 * seconds / count : seconds / count;
+            used += seconds;
+            segment += count;
+        } while( segment < segmentCount && used + segmentCost < budget );
+
+        // Send the rendered rows to the texture, the end of a row that isn't finished shows the last pass.
+        int lastRow = (segment - 1) / segmentsPerRow;
+        if( moved ) texture.setRect( 0, 0, width, height, pixels );
+        else texture.setRect( 0, firstRow, width, lastRow - firstRow + 1, &pixels[firstRow * width] );
+
+        ry = segment / segmentsPerRow;
+        if( segment == segmentCount ){
+            passes++;
+            segment = ry = 0;
+            pathGuide.endPass(guidingPasses);
+        }
         unsigned int endTicks = SDL_GetTicks();
         renderTime = (endTicks - startTicksLoop) / 1000.0;
-        if( ry >= height ){
-            rendering = false;
-            std::cout << "Render Time: " << renderTime << std::endl;
+        if( passes == samples ) std::cout << "Render Time: " << renderTime << std::endl;
+    }
+
+    // Back to the coarsest preview, the passes start again.
+    void restartRefinement(){
+        previewScale = 8;
+        passes = 0;
+        segment = ry = 0;
+        history.assign(width * height, PixelHistory());
+        keepMovedCamera();
+        startTicksLoop = moveTicks;
+        loopScene = sceneVersion;
+        loopSettings = settingsVersion;
+        recordsValid = recordPaths();
+        if( recordsValid ) pathRecords.clear(width * height);
+        else pathRecords = PathRecords(); // Gives the memory back.
+    }
+
+    // Path replay works for paths traced by shade() alone, one ray at a time.
+    bool recordPaths(){
+        return pathReplay && traceFunctionType == MODE_PATH && irradianceCaching == 0 && !analyticLights();
+    }
+
+    // The pixels whose samples met an edited material get the radiance of their recorded paths with the new
+    // albedos in place of their samples, without tracing. The others keep their samples. The passes after
+    // the recorded ones are done again.
+    void replayPaths(){
+        int pixelCount = width * height;
+#pragma omp parallel for schedule(dynamic, 1024)
+        for( int i = 0; i < pixelCount; ++i ) {
+            if( !(pathRecords.materials[i] & editedMaterials) ) continue;
+            int count;
+            glm::vec3 sum = pathRecords.replay(i, materialTable.materials, count);
+            if( count == 0 ) continue;
+            history[i].sum = glm::vec4(sum.x, sum.y, sum.z, (float)count);
+            pixels[i] = glm::vec4(sum.x / count, sum.y / count, sum.z / count, 1.0f);
+        }
+        if( passes >= replaySamples ){
+            passes = replaySamples;
+            segment = ry = 0;
+        }
+        loopSettings = settingsVersion;
+        startTicksLoop = SDL_GetTicks();
+    }
+
+    void keepMovedCamera(){
+        movedEye = camera.eye;
+        movedLookat = camera.lookat;
+        movedFov = camera.fov;
+        movedAperture = camera.aperture;
+        moveTicks = SDL_GetTicks();
+    }
+
+    // Moves the samples of each pixel to where its surface is seen from the moved camera, the closest one
+    // where several land. Pixels nothing lands on start again, and show what they showed before until
+    // they are traced. The pass goes on where it was, the count of passes starts again.
+    // The center ray of a moved pixel is traced before it gets new samples (checkHistory), the history is
+    // dropped if it sees another object or is too far off in depth (a surface that was hidden).
+    // False if less than half of the image keeps its samples, then the move was too large.
+    bool reproject(){
+        if( !reprojection || camera.aperture >= 0.00001 ) return false;
+        int pixelCount = width * height;
+        // Per pixel the closest sample that lands there: the distance bits (positive floats order like
+        // integers) above the pixel it comes from.
+        std::unique_ptr<std::atomic<uint64_t>[]> closest(new std::atomic<uint64_t>[pixelCount]);
+#pragma omp parallel for
+        for( int i = 0; i < pixelCount; ++i ) closest[i] = UINT64_MAX;
+#pragma omp parallel for
+        for( int i = 0; i < pixelCount; ++i ) {
+            const PixelHistory& h = history[i];
+            float x, y;
+            if( h.object < 0 || h.sum.w <= 0 || !camera.project(h.position, x, y) ) continue;
+            int px = (int)floorf(x), py = (int)floorf(y);
+            if( px < 0 || py < 0 || px >= width || py >= height ) continue;
+            float d = glm::length(h.position - camera.eye);
+            uint32_t bits;
+            memcpy(&bits, &d, sizeof(bits));
+            uint64_t key = (uint64_t)bits << 32 | (uint32_t)i;
+            std::atomic<uint64_t>& target = closest[py * width + px];
+            uint64_t current = target;
+            while( key < current && !target.compare_exchange_weak(current, key) );
+        }
+
+        int kept = 0;
+        movedHistory.resize(pixelCount);
+#pragma omp parallel for reduction(+:kept)
+        for( int i = 0; i < pixelCount; ++i ) {
+            PixelHistory& m = movedHistory[i];
+            uint64_t key = closest[i];
+            if( key == UINT64_MAX ){
+                m = PixelHistory();
+                continue;
+            }
+            m = history[(uint32_t)key];
+            m.checked = false;
+            if( m.sum.w > reprojectionHistory ) m.sum *= reprojectionHistory / m.sum.w;
+            pixels[i] = glm::vec4(m.sum.x / m.sum.w, m.sum.y / m.sum.w, m.sum.z / m.sum.w, 1.0f);
+            kept++;
+        }
+        if( kept < pixelCount / 2 ) return false;
+        history.swap(movedHistory);
+        recordsValid = false; // The recorded paths are of the old view.
+        passes = 0;
+        keepMovedCamera();
+        return true;
+    }
+
+    // The surface seen through the pixel center with the current camera, the samples are dropped if
+    // they were moved here from another surface.
+    void checkHistory( int x, int y ){
+        PixelHistory& h = history[y * width + x];
+        Hit hit = firstIntersect(camera.getRay(x + 0.5f, y + 0.5f));
+        int object = -1;
+        if( hit.valid ){
+            const Material& material = materialTable[hit.material];
+            if( material.diffuse() || material.emissive() ) object = hit.object->objectId;
+        }
+        if( h.sum.w > 0 ){
+            float d = glm::length(hit.position - camera.eye), previous = glm::length(h.position - camera.eye);
+            if( object < 0 || object != h.object || fabs(d - previous) > 0.05f * previous ) h.sum = glm::vec4(0, 0, 0, 0);
+        }
+        h.position = hit.position;
+        h.object = object;
+        h.checked = true;
+    }
+
+    // The image at 1 / scale of the resolution, one ray through the center of each block of pixels fills the block.
+    void renderCoarse( int scale ){
+        int w = (width + scale - 1) / scale, h = (height + scale - 1) / scale;
+#pragma omp parallel for schedule(dynamic, 16)
+        for (int i = 0; i < w * h; i++) {
+            int x0 = (i % w) * scale, y0 = (i / w) * scale;
+            int x1 = std::min(x0 + scale, width), y1 = std::min(y0 + scale, height);
+            glm::vec3 color = traceFunction(camera.getRay(0.5f * (x0 + x1), 0.5f * (y0 + y1)));
+            for (int y = y0; y < y1; y++)
+                for (int x = x0; x < x1; x++)
+                    pixels[y * width + x] = glm::vec4(color.x, color.y, color.z, 1.0f);
+        }
+    }
+
+    // Row segments first to first + count - 1 of the current pass, one sample per pixel, added to the history.
+    void renderSegments( int first, int count ){
+        int segmentsPerRow = (width + 7) / 8;
+        bool packets = usePackets() && !recordsValid;
+        bool recording = recordsValid && passes < replaySamples;
+#pragma omp parallel for schedule(dynamic)
+        for (int i = first; i < first + count; i++) {
+            int x0 = (i % segmentsPerRow) * 8, y = i / segmentsPerRow, w = std::min(8, width - x0);
+            glm::vec4* row = &pixels[y * width];
+            if( packets ) renderTile(x0, y, w, 1, row, width, 1);
+            else {
+                for (int x = x0; x < x0 + w; x++) {
+                    int pixel = y * width + x;
+                    pathRecorder.vertices = recording ? &pathRecords.paths[pixel] : nullptr;
+                    pathRecorder.materials = 0;
+                    pathRecorder.first = true;
+                    glm::vec3 color = getColor(x, y, passes, 1);
+                    // A path without vertices still counts as a sample.
+                    if( pathRecorder.first ) pathRecorder.record(noAlbedo, glm::vec3(0, 0, 0), glm::vec3(0, 0, 0));
+                    pathRecorder.vertices = nullptr;
+                    if( recordsValid ) pathRecords.materials[pixel] |= pathRecorder.materials;
+                    row[x] = glm::vec4(color.x, color.y, color.z, 1.0f);
+                }
+            }
+            for (int x = x0; x < x0 + w; x++) {
+                if( reprojection && !history[y * width + x].checked ) checkHistory(x, y);
+                glm::vec4& s = history[y * width + x].sum;
+                s += glm::vec4(row[x].x, row[x].y, row[x].z, 1.0f);
+                row[x] = glm::vec4(s.x / s.w, s.y / s.w, s.z / s.w, 1.0f);
+            }
         }
     }
 
@@ -272,6 +792,28 @@ public:
     void render(std::vector<glm::vec4>& image){
         rendering = false;
         unsigned int startTicks = SDL_GetTicks();
+        startPathGuide();
+        resetIrradianceCache();
+        prepareHitCache();
+
+        if( pathGuide.training ){
+            renderPasses(image);
+            unsigned int endTicks = SDL_GetTicks();
+            renderTime = (endTicks - startTicks) / 1000.0;
+            return;
+        }
+
+        if( usePackets() ){
+            int tilesX = (width + 7) / 8, tilesY = (height + 7) / 8;
+#pragma omp parallel for schedule(dynamic)
+            for (int i = 0; i < tilesX * tilesY; i++) {
+                int x = (i % tilesX) * 8, y = (i / tilesX) * 8;
+                renderTile(x, y, std::min(8, width - x), std::min(8, height - y), &image[y * width], width, samples);
+            }
+            unsigned int endTicks = SDL_GetTicks();
+            renderTime = (endTicks - startTicks) / 1000.0;
+            return;
+        }
 
         for (int y = 0; y < height; y++) {
             std::cout << (float)y / height * 100.0 << "                \r";
@@ -286,20 +828,175 @@ public:
         std::cout << "100                \r";
     }
 
+    // The image in passes of one sample per pixel, the path guide learns after each of them.
+    void renderPasses(std::vector<glm::vec4>& image){
+        std::vector<glm::vec4> pass(width * height);
+        image.assign(width * height, glm::vec4(0, 0, 0, 0));
+        bool packets = usePackets();
+        int tilesX = (width + 7) / 8, tilesY = (height + 7) / 8;
+        for( int p = 0; p < samples; ++p ) {
+#pragma omp parallel for schedule(dynamic)
+            for( int i = 0; i < tilesX * tilesY; i++ ) {
+                int x0 = (i % tilesX) * 8, y0 = (i / tilesX) * 8, w = std::min(8, width - x0), h = std::min(8, height - y0);
+                if( packets ) renderTile(x0, y0, w, h, &pass[y0 * width], width, 1);
+                else {
+                    for( int y = y0; y < y0 + h; y++ )
+                        for( int x = x0; x < x0 + w; x++ ) {
+                            glm::vec3 color = getColor(x, y, p, 1);
+                            pass[y * width + x] = glm::vec4(color.x, color.y, color.z, 1.0f);
+                        }
+                }
+            }
+            for( int i = 0; i < width * height; i++ ) image[i] += pass[i];
+            pathGuide.endPass(guidingPasses);
+        }
+        for( auto& pixel : image ) pixel = glm::vec4(pixel.x / samples, pixel.y / samples, pixel.z / samples, 1.0f);
+    }
+
+    // The modes of traceFunction, whose samples start from the first hit of a camera ray. The others have
+    // renderers of their own, which use neither packets nor the hit cache.
+    bool startsFromCameraHit(){
+        switch( traceFunctionType ) {
+            case MODE_PATH: case MODE_DIRECT: case MODE_AO: case MODE_NORMALS: case MODE_DEPTH: case MODE_OBJECT_IDS:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // The modes that color the first hit by its geometry, see geometryColor.
+    bool showsGeometry(){
+        return traceFunctionType == MODE_NORMALS || traceFunctionType == MODE_DEPTH || traceFunctionType == MODE_OBJECT_IDS;
+    }
+
+    // Camera rays can be traced as packets if they share the origin. The hit cache is used instead when it is on.
+    bool usePackets(){
+        return packetTracing && !useHitCache() && camera.aperture < 0.00001 && startsFromCameraHit();
+    }
+
+    // With a pinhole camera, the first hits can be cached.
+    bool useHitCache(){
+        return hitCaching && camera.aperture < 0.00001 && startsFromCameraHit();
+    }
+
+    void prepareHitCache(){
+        if( useHitCache() ) hitCache.prepare(camera, width, height, sceneVersion);
+    }
+
+    // Render a tile of at most 8x8 pixels with packets of primary rays (and shadow rays for direct lighting).
+    // Pixel (x, y) goes to out[(y - y0) * stride + x].
+    void renderTile( int x0, int y0, int w, int h, glm::vec4* out, int stride, int sampleCount ){
+        int n = w * h;
+        glm::vec3 colors[maxPacketSize];
+        for( int j = 0; j < n; ++j ) colors[j] = glm::vec3(0, 0, 0);
+
+        RayPacket packet;
+        RayPacket shadowPacket;
+        for( int i = 0; i < sampleCount; ++i ) {
+            packet.size = n;
+            for( int j = 0; j < n; ++j )
+                packet.set(j, camera.getRay(float(x0 + j % w) + randomFloat(), float(y0 + j / w) + randomFloat()));
+            glm::vec3 corners[4] = { camera.getRay(x0, y0).dir, camera.getRay(x0 + w, y0).dir,
+                                     camera.getRay(x0 + w, y0 + h).dir, camera.getRay(x0, y0 + h).dir };
+            packet.setFrustum(camera.eye, corners);
+            bvh.intersectPacket(packet, firstRays(n));
+
+            for( int j = 0; j < n; ++j ) orientHit(packet.ray(j), packet.hits[j]);
+
+            if( traceFunctionType == MODE_PATH ){
+                for( int j = 0; j < n; ++j )
+                    colors[j] += shade(packet.ray(j), packet.hits[j], 1);
+                continue;
+            }
+            if( traceFunctionType == MODE_AO ){
+                // Occlusion rays go every way, they are traced one by one.
+                for( int j = 0; j < n; ++j )
+                    colors[j] += ambientOcclusion(packet.hits[j]);
+                continue;
+            }
+            if( showsGeometry() ){
+                for( int j = 0; j < n; ++j )
+                    colors[j] += geometryColor(packet.hits[j]);
+                continue;
+            }
+
+            // Shadow rays to the directional light are parallel, trace them as a packet too.
+            PacketMask hitting = 0;
+            shadowPacket.size = n;
+            for( int j = 0; j < n; ++j ) {
+                const Hit& hit = packet.hits[j];
+                if( !hit.valid ) continue;
+                shadowPacket.set(j, Ray(hit.position + hit.normal * eps, dLight.direction));
+                hitting |= PacketMask(1) << j;
+            }
+            bvh.occludedPacket(shadowPacket, hitting);
+            for( int j = 0; j < n; ++j )
+                colors[j] += shadeDirect(packet.ray(j), packet.hits[j], packet.hits[j].valid && shadowPacket.occluded[j]);
+        }
+
+        for( int j = 0; j < n; ++j ) {
+            glm::vec3 color = colors[j] / (float)sampleCount;
+            out[(j / w) * stride + x0 + j % w] = glm::vec4(color.x, color.y, color.z, 1.0f);
+        }
+    }
+
     glm::vec3 getColor( int x, int y ){
+        return getColor(x, y, 0, samples);
+    }
+
+    // Average of samples first to first + count - 1 of the pixel.
+    glm::vec3 getColor( int x, int y, int first, int count ){
         glm::vec3 color = glm::vec3(0, 0, 0);
-        for (int i = 0; i < samples; ++i) {
+        bool cached = useHitCache();
+        for (int i = first; i < first + count; ++i) {
+            if( cached ){
+                Hit hit;
+                Ray ray = cachedCameraRay(x, y, i, hit);
+                color += shadeFirstHit(ray, hit);
+                continue;
+            }
             Ray ray = camera.getRay(float(x) + randomFloat(), float(y) + randomFloat());
             color += traceFunction(ray);
         }
-        color /= samples;
+        color /= count;
 
         return color;
     }
 
+    // Camera ray through jitter position i of the pixel, and its first hit from the hit cache when it is there.
+    Ray cachedCameraRay( int x, int y, int i, Hit& hit ){
+        int pixel = y * width + x, j = i % hitCache.jitters;
+        glm::vec2 offset = hitCache.jitter(pixel, j);
+        Ray ray = camera.getRay(float(x) + offset.x, float(y) + offset.y);
+        Object* object;
+        if( !hitCache.lookup(pixel, j, object) ){
+            hit = bvh.intersect(ray, infinity);
+            hitCache.store(pixel, j, hit.valid ? hit.object : nullptr);
+        }else if( object ){
+            // The same ray, the cached primitive is still the closest.
+            hit = object->intersect(ray, infinity);
+        }
+        orientHit(ray, hit);
+        return ray;
+    }
+
+    // As traceFunction, for a camera ray with its first hit already found.
+    glm::vec3 shadeFirstHit(const Ray& ray, const Hit& hit) {
+        if(traceFunctionType == MODE_PATH) return maxDepth >= 1 ? shade(ray, hit, 1) : glm::vec3(0, 0, 0);
+        else if(traceFunctionType == MODE_DIRECT){
+            if( !hit.valid ) return backgroundColor(ray);
+            return shadeDirect(ray, hit, shadowIntersect(Ray(hit.position + hit.normal * eps, dLight.direction)));
+        }
+        else if(traceFunctionType == MODE_AO) return ambientOcclusion(hit);
+        else if(showsGeometry()) return geometryColor(hit);
+        return glm::vec3( 0, 0, 0);
+    }
+
     glm::vec3 traceFunction(const Ray& ray) {
-        if(traceFunctionType == 0) return trace(ray);
-        else if(traceFunctionType == 1) return traceDirectOnly(ray);
+        if(traceFunctionType == MODE_PATH) return trace(ray);
+        else if(traceFunctionType == MODE_DIRECT) return traceDirectOnly(ray);
+        else if(traceFunctionType == MODE_AO) return traceAmbientOcclusion(ray);
+        else if(showsGeometry()) return geometryColor(firstIntersect(ray));
         return glm::vec3( 0, 0, 0);
     }
 
@@ -308,67 +1005,268 @@ public:
         if( depth > maxDepth ) return glm::vec3(0, 0, 0);
 
         Hit hit = firstIntersect(ray);
-        if( !hit.valid) return backgroundColor(ray);
+        return shade(ray, hit, depth);
+    }
 
-        glm::vec3 radiance(0, 0, 0);
-        addPointShadow(hit, radiance);
+    // Radiance along the ray, from its (oriented) closest hit.
+    // Records the path in pathRecorder, with the albedos left out (see PathVertex).
+    glm::vec3 shade(const Ray& ray, const Hit& hit, int depth){
+        const glm::vec3 zero(0, 0, 0);
+        if( !hit.valid){
+            glm::vec3 background = backgroundColor(ray);
+            pathRecorder.record(noAlbedo, background, zero);
+            return background;
+        }
+        pathRecorder.materials |= materialBit(hit.material);
+
+        const Material& material = materialTable[hit.material];
+        glm::vec3 pointLight = pointShadowLight(hit);
+        glm::vec3 radiance = material.albedo * pointLight;
 
         float pdf = 1.0;
         glm::vec3 attenuation( 0, 0, 0);
-        if( hit.object->material->emissive() ) {
-            return hit.object->material->emit(hit);
+        if( material.emissive() ) {
+            pathRecorder.record(hit.material, hit.frontFace ? glm::vec3(1, 1, 1) : zero, zero);
+            return material.emit(hit);
         }
 
-        Ray newRay = hit.object->material->scatter(ray, hit, attenuation, pdf);
+        Ray newRay = material.scatter(ray, hit, attenuation, pdf);
         if( attenuation.x < 0 ) return glm::vec3(0, 0, 0); // New ray is wrong.
+        continueCone(ray, hit, newRay);
 
         // If reflective or refractive pdf is 1.
-        if( hit.object->material->noPdf() ){
+        if( material.noPdf() ){
+            // Glass passes all light on, mirrors their albedo (and texture).
+            if( pathRecorder.vertices ) pathRecorder.record(material.transparent() ? noAlbedo : hit.material, zero,
+                                                            material.transparent() ? attenuation : material.textureAt(hit));
             radiance += attenuation * trace(newRay, depth + 1);
             return radiance;
         }
 
-        if( emissiveList.empty() ){
+        if( irradianceCaching > 0 && depth == irradianceCaching ) return radiance + shadeCached(ray, hit, depth);
+        // Not at the last depth, a light ray from there would be too deep, as in trace().
+        if( analyticLights() && depth < maxDepth ) radiance += analyticDirect(hit);
+
+        if( !sampleDiffuse(hit, newRay, pdf) ){
+            pathRecorder.record(hit.material, pointLight, zero);
+            return radiance;
+        }
+        continueCone(ray, hit, newRay);
+
+        if( pathRecorder.vertices ) pathRecorder.record(hit.material, pointLight, material.textureAt(hit) * material.pdf(ray, hit, newRay) / pdf);
+        glm::vec3 incoming = traceBounce(newRay, depth + 1);
+        // The guide learns the incoming light alone, surfaces that face other ways share its regions.
+        if( pathGuide.training ) pathGuide.record(hit.position, newRay.dir, luminance(incoming) / pdf);
+        radiance += attenuation * material.pdf(ray, hit, newRay) * incoming / pdf;
+        return radiance;
+    }
+
+
+    // Diffuse hit with the bounced light from the irradiance cache, making a record if none is close enough.
+    // Direct light from emitters is sampled as usual, it changes too fast for the cache.
+    glm::vec3 shadeCached(const Ray& ray, const Hit& hit, int depth){
+        glm::vec3 irradiance;
+        if( !irradianceCache.lookup(hit.position, hit.normal, irradiance) ){
+            IrradianceCache::Record record = irradianceCache.compute(hit.position, hit.normal, hit.coneWidth,
+                [&](const glm::vec3& dir, float& dist){
+                    Ray gatherRay(hit.position + hit.normal * eps, dir);
+                    continueCone(ray, hit, gatherRay);
+                    Hit gatherHit = firstIntersect(gatherRay);
+                    if( !gatherHit.valid ) return glm::vec3(0, 0, 0);
+                    dist = gatherHit.t;
+                    if( materialTable[gatherHit.material].emissive() ) return glm::vec3(0, 0, 0);
+                    return shade(gatherRay, gatherHit, depth + 1);
+                });
+            irradianceCache.add(record);
+            irradiance = record.irradiance;
+        }
+        return sampleEmitters(ray, hit) + materialTable[hit.material].albedoAt(hit) / glm::pi<float>() * irradiance;
+    }
+
+    bool analyticLights() const { return analyticLighting && !polygonLights.empty(); }
+
+    bool isPolygonLight(Object* object) const {
+        return std::binary_search(polygonLights.begin(), polygonLights.end(), object);
+    }
+
+    // trace() for rays leaving a diffuse hit, without the emitters analyticDirect counted there.
+    glm::vec3 traceBounce(const Ray& ray, int depth){
+        if( !analyticLights() ) return trace(ray, depth);
+        if( depth > maxDepth ) return glm::vec3(0, 0, 0);
+        Hit hit = firstIntersect(ray);
+        if( hit.valid && isPolygonLight(hit.object) ) return glm::vec3(0, 0, 0);
+        return shade(ray, hit, depth);
+    }
+
+    // Light from the flat emitters reflected at a diffuse hit. Without shadows it is exact (Lambert's
+    // polygon formula), the shadows scale it by a ratio estimate (Heitz et al. 2018): the same few points
+    // on the lights, chosen by their unshadowed light, estimate the light with and without visibility.
+    // Smooth where the lights are fully visible or hidden, noise only in the penumbrae.
+    glm::vec3 analyticDirect(const Hit& hit){
+        static thread_local std::vector<float> weights;
+        weights.assign(polygonLights.size(), 0);
+        const glm::vec3 albedo = materialTable[hit.material].albedoAt(hit);
+        glm::vec3 unshadowed(0, 0, 0);
+        float weightSum = 0;
+        glm::vec3 corners[8];
+        for( int i = 0; i < polygonLights.size(); ++i ) {
+            Object* light = polygonLights[i];
+            int count = light->polygon(corners);
+            glm::vec3 lightNormal;
+            float cosTheta;
+            light->normalCone(lightNormal, cosTheta);
+            if( glm::dot(hit.position - corners[0], lightNormal) <= 0 ) continue; // Behind, it emits on one side.
+            glm::vec3 reflected = albedo / glm::pi<float>() * materialTable[light->material].emit(Hit())
+                                  * polygonIrradiance(corners, count, hit.position, hit.normal);
+            unshadowed += reflected;
+            weights[i] = luminance(reflected);
+            weightSum += weights[i];
+        }
+        if( !(weightSum > 0) ) return glm::vec3(0, 0, 0);
+
+        float shadowed = 0, all = 0;
+        for( int k = 0; k < analyticShadowRays; ++k ) {
+            float u = randomFloat() * weightSum;
+            int i = 0;
+            while( i < (int)weights.size() - 1 && (u -= weights[i]) >= 0 ) i++;
+            Object* light = polygonLights[i];
+
+            glm::vec3 lightNormal;
+            glm::vec3 point = light->emissionPoint(lightNormal);
+            glm::vec3 toLight = point - hit.position;
+            float dist2 = length2(toLight);
+            float dist = sqrtf(dist2);
+            glm::vec3 dir = toLight / dist;
+            float cosSurface = glm::dot(hit.normal, dir), cosLight = -glm::dot(lightNormal, dir);
+            if( cosSurface <= 0 || cosLight <= 0 ) continue;
+            // Integrand over the light's area divided by the pdf of the point.
+            float radiance = luminance(albedo * materialTable[light->material].emit(Hit()));
+            float f = radiance * cosSurface * cosLight / dist2 * light->area() * weightSum / weights[i];
+            all += f;
+            if( !bvh.occluded(Ray(hit.position + hit.normal * eps, dir), dist * 0.999f) ) shadowed += f;
+        }
+        if( all > 0 ) unshadowed *= shadowed / all;
+        return unshadowed;
+    }
+
+    // Light from emitters and the background reflected at a diffuse hit, from one direction of the
+    // light / cosine mixture. Bounced light is left out.
+    glm::vec3 sampleEmitters(const Ray& ray, const Hit& hit){
+        Ray newRay(hit.position, hit.normal);
+        float pdf;
+        if( !sampleDiffuse(hit, newRay, pdf) ) return glm::vec3(0, 0, 0);
+        Hit lightHit = firstIntersect(newRay);
+        glm::vec3 incoming = !lightHit.valid ? backgroundColor(newRay) : materialTable[lightHit.material].emit(lightHit);
+        const Material& material = materialTable[hit.material];
+        return material.albedoAt(hit) * material.pdf(ray, hit, newRay) * incoming / pdf;
+    }
+
+    // New direction at a diffuse hit, from the mix of light and cosine sampling.
+    // Returns false if no usable direction was found.
+    bool sampleDiffuse(const Hit& hit, Ray& newRay, float& pdf){
+        int guideCell = pathGuiding ? pathGuide.samplingCell(hit.position) : -1;
+        // Emitters lit analytically give nothing to bounce rays, they aren't aimed at them.
+        bool sampleLights = !emissiveList.empty() && !(analyticLights() && polygonLights.size() == lightList.emitters.size());
+        if( !sampleLights && !environment.loaded() && guideCell < 0 ){
             CosinePDF cosinePdf(hit.normal);
             newRay = Ray( hit.position + hit.normal * eps, cosinePdf.generateNewDir());
             pdf = cosinePdf.pdf(hit, newRay.dir);
-        }else {
-            ObjectListPDF *objectPdf = new ObjectListPDF(emissiveList, hit.position);
-            CosinePDF *cosinePdf = new CosinePDF(hit.normal);
-            MixturePDF mixturePdf(objectPdf, cosinePdf);
+            return true;
+        }
 
-            newRay = Ray(hit.position + hit.normal * eps, mixturePdf.generateNewDir());
+        // Emitters, environment and cosine with equal weights, the guide as much as them together.
+        MixturePDF mixturePdf;
+        PDF *lightPdf = sampleLights ? makeLightPDF(hit) : nullptr;
+        EnvironmentPDF environmentPdf(environment);
+        GuidePDF guidePdf(pathGuide, guideCell, hit.normal);
+        CosinePDF cosinePdf(hit.normal);
+        if( lightPdf ) mixturePdf.add(lightPdf, 1);
+        if( environment.loaded() ) mixturePdf.add(&environmentPdf, 1);
+        mixturePdf.add(&cosinePdf, 1);
+        if( guideCell >= 0 ) mixturePdf.add(&guidePdf, mixturePdf.pdfs.size());
+        mixturePdf.normalize();
+
+        glm::vec3 newDir = mixturePdf.generateNewDir();
+        if( length2(newDir) == 0 ) pdf = 0; // No light could be chosen.
+        else {
+            newRay = Ray(hit.position + hit.normal * eps, newDir);
             pdf = mixturePdf.pdf(hit, newRay.dir);
-
-            delete objectPdf;
-            delete cosinePdf;
-
-            if (pdf < 0.0001) return glm::vec3(0, 0, 0);
         }
 
-        radiance += attenuation * hit.object->material->pdf(ray, hit, newRay) *  trace(newRay, depth + 1) / pdf;
-        return radiance;
+        delete lightPdf;
+
+        return pdf >= 0.0001;
     }
 
+    // Pdf for choosing directions towards the emitters.
+    PDF* makeLightPDF(const Hit& hit){
+        if( lightSelectionType == 1 && !lightBVH.empty() )
+            return new LightBVHPDF(lightBVH, hit.position, hit.normal);
+        if( lightSelectionType == 2 && !lightList.emitterTable.empty() )
+            return new PowerLightPDF(lightList, lightBVH, hit.position);
+        return new ObjectListPDF(emissiveList, hit.position);
+    }
 
     void addPointShadow(const Hit& hit, glm::vec3& radiance){
-        if( !hit.object->material->diffuse()) return;
-        for( auto light : lights ) {
-            bool shadow = shadowIntersect(hit, light.position);
-            if (!shadow) {
-                float dist2 = glm::dot(light.position - hit.position, light.position - hit.position);
-                if (dist2 < eps) dist2 = eps;
-                glm::vec3 lightRad = light.power / dist2 / 4.0f / 3.1415f;
-                glm::vec3 lightDir = glm::normalize(light.position - hit.position);
-                float cost = glm::dot(hit.normal, lightDir);
-
-                radiance += hit.object->material->albedo * cost * lightRad;
+        radiance += materialTable[hit.material].albedo * pointShadowLight(hit);
+    }
+
+    // Light from the point lights (with shadows) reflected at the hit, divided by the albedo of its material.
+    glm::vec3 pointShadowLight(const Hit& hit){
+        glm::vec3 light(0, 0, 0);
+        forEachPointLightSample(hit, [&](const Light& pointLight, float weight){
+            if( !shadowIntersect(hit, pointLight.position) )
+                light += pointLightIrradiance(hit, pointLight) * weight;
+        });
+        if( light == glm::vec3(0, 0, 0) ) return light;
+        return materialTable[hit.material].textureAt(hit) * light;
+    }
+
+    // Calls f(light, weight) for the point lights a diffuse hit takes shadow rays to.
+    template<typename F>
+    void forEachPointLightSample(const Hit& hit, F f){
+        if( !materialTable[hit.material].diffuse()) return;
+
+        // Constant number of shadow rays, lights chosen by power.
+        if( lightSelectionType == 2 ){
+            if( lightList.pointTable.empty() ) return;
+            for( int i = 0; i < lightSamples; ++i ) {
+                float pmf;
+                int l = lightList.pointTable.sample(randomFloat(), pmf);
+                f(lights[l], 1.0f / (pmf * lightSamples));
             }
+            return;
         }
+
+        for( const auto& light : lights )
+            f(light, 1.0f);
+    }
+
+    // How many times forEachPointLightSample calls f for the hit.
+    int pointLightSampleCount(const Hit& hit){
+        if( !materialTable[hit.material].diffuse()) return 0;
+        if( lightSelectionType == 2 ) return lightList.pointTable.empty() ? 0 : lightSamples;
+        return lights.size();
+    }
+
+    glm::vec3 unshadowedPointLight(const Hit& hit, const Light& light){
+        return materialTable[hit.material].albedoAt(hit) * pointLightIrradiance(hit, light);
+    }
+
+    // What a white surface at the hit reflects of a point light, without the shadow.
+    glm::vec3 pointLightIrradiance(const Hit& hit, const Light& light){
+        float dist2 = glm::dot(light.position - hit.position, light.position - hit.position);
+        if (dist2 < eps) dist2 = eps;
+        glm::vec3 lightRad = light.power / dist2 / 4.0f / 3.1415f;
+        glm::vec3 lightDir = glm::normalize(light.position - hit.position);
+        float cost = glm::dot(hit.normal, lightDir);
+
+        return cost * lightRad;
     }
 
     // Background color (if no object is hit).
     glm::vec3 backgroundColor(const Ray& ray){
+        if( environment.loaded() ) return environment.radiance(ray.dir);
         float h = 0.5 * (ray.dir.z + 1.0);
         return (1 - h) * backGroundColor1 + h * backGroundColor2;
     }
@@ -376,26 +1274,40 @@ public:
     // Get closest intersection with bvh.
     Hit firstIntersect(const Ray& ray){
         Hit bestHit = bvh.intersect(ray, infinity);
+        orientHit(ray, bestHit);
+        return bestHit;
+    }
+
+    void orientHit(const Ray& ray, Hit& hit){
+        if( !hit.valid ) return;
         // If the normal vertexFaces away from us (looking at backface).
-        if(bestHit.valid && glm::dot(ray.dir, bestHit.normal) > 0 ) {
-            bestHit.normal = bestHit.normal * -1.0f;
-            bestHit.frontFace = false;
+        float cost = glm::dot(ray.dir, hit.normal);
+        if( cost > 0 ) {
+            hit.normal = hit.normal * -1.0f;
+            hit.frontFace = false;
         }
-        return bestHit;
+
+        // Footprint of the ray cone, stretched at grazing angles.
+        hit.coneWidth = ray.coneWidth + hit.t * ray.coneAngle;
+        hit.footprint = hit.coneWidth * hit.uvDensity / fmax(glm::abs(cost), 0.05f);
+    }
+
+    // The cone of a ray leaving the hit. Surface curvature is ignored, the spread stays the same.
+    void continueCone(const Ray& ray, const Hit& hit, Ray& newRay){
+        newRay.coneWidth = hit.coneWidth;
+        newRay.coneAngle = ray.coneAngle;
     }
 
     // Shadow from directional dLight with bvh.
     bool shadowIntersect(Ray ray){
-        Hit hit = bvh.intersect(ray, infinity);
-        return hit.valid;
+        return bvh.occluded(ray, infinity);
     }
 
     // Shadow intersect with single point light, with bhv.
     bool shadowIntersect( Hit hit, glm::vec3 lightPos){
         Ray ray( hit.position + hit.normal * eps, lightPos - hit.position);
         float dist = glm::length(lightPos - hit.position);
-        Hit shadowHit = bvh.intersect(ray, dist);
-        return shadowHit.valid;
+        return bvh.occluded(ray, dist);
     }
 
     // ===============================================================================
@@ -408,12 +1320,16 @@ public:
         }
 
         Ray shadowRay( hit.position + hit.normal * eps, dLight.direction );
-        bool shadow = shadowIntersect( shadowRay );
+        return shadeDirect(ray, hit, shadowIntersect( shadowRay ));
+    }
+
+    // Blinn Phong color of a hit, with the shadow test already done.
+    glm::vec3 shadeDirect( const Ray& ray, const Hit& hit, bool shadow ){
+        if( !hit.valid ) return backgroundColor(ray);
 
-        // Blinn Phong.
         glm::vec3 radiance( 0, 0, 0 );
-        Material * material = hit.object->material;
-        radiance += dLight.ambient * material->ambient;
+        const Material& material = materialTable[hit.material];
+        radiance += dLight.ambient * material.ambient * material.textureAt(hit);
         if( !shadow ){
             glm::vec3 L = glm::normalize(dLight.direction );
             glm::vec3 H = glm::normalize( L - ray.dir );
@@ -421,13 +1337,48 @@ public:
             float cost = max( glm::dot( hit.normal, L ), 0.0f );
             float cosd = max( glm::dot( hit.normal, H ), 0.0f );
 
-            radiance += dLight.diffuse * material->albedo * cost;
-            radiance += dLight.specular * material->specular * pow(cosd, material->shininess );
+            radiance += dLight.diffuse * material.albedoAt(hit) * cost;
+            radiance += dLight.specular * material.specular * pow(cosd, material.shininess );
         }
 
         return radiance;
     }
 
+    // ===============================================================================
+    // Fast modes for looking at the geometry, no materials or lights. Misses are black.
+
+    // Fraction of cosine weighted rays that leave the hit without meeting anything within aoDistance.
+    glm::vec3 traceAmbientOcclusion( const Ray& ray ){
+        return ambientOcclusion(firstIntersect(ray));
+    }
+
+    glm::vec3 ambientOcclusion( const Hit& hit ){
+        if( !hit.valid ) return glm::vec3(0, 0, 0);
+        ONB onb(hit.normal);
+        int open = 0;
+        for( int k = 0; k < aoSamples; ++k ) {
+            Ray ray(hit.position + hit.normal * eps, onb.get(randomCosineVec3()));
+            if( !bvh.occluded(ray, aoDistance) ) open++;
+        }
+        return glm::vec3(1, 1, 1) * (float(open) / aoSamples);
+    }
+
+    // Normals: facing the camera, mapped to [0, 1]. Depth: distance, black to white over depthRange.
+    // Object ids: a color for each objectId.
+    glm::vec3 geometryColor( const Hit& hit ){
+        if( !hit.valid ) return glm::vec3(0, 0, 0);
+        if( traceFunctionType == MODE_NORMALS ) return hit.normal * 0.5f + glm::vec3(0.5, 0.5, 0.5);
+        if( traceFunctionType == MODE_DEPTH ) return glm::vec3(1, 1, 1) * fmin(hit.t / depthRange, 1.0f);
+
+        uint64_t id = hit.object->objectId;
+        // Mix the bits (splitmix64), so close ids get unlike colors.
+        id += 0x9E3779B97F4A7C15ull;
+        id = (id ^ (id >> 30)) * 0xBF58476D1CE4E5B9ull;
+        id = (id ^ (id >> 27)) * 0x94D049BB133111EBull;
+        id ^= id >> 31;
+        return glm::vec3(id & 255, (id >> 8) & 255, (id >> 16) & 255) / 255.0f;
+    }
+
     // Get closest intersection, without bvh.
     Hit firstIntersectNoBVH(const Ray& ray){
         Hit bestHit;
@@ -0,0 +1,385 @@
+#pragma once
+
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+
+#include "Trace.h"
+
+// Wavefront (stream) path tracer. Same result as Trace::trace, but instead of following one path
+// at a time, a large batch of paths is advanced stage by stage: extend (intersect) every active path,
+// sort the hits into queues by material type, shade each queue, trace all shadow rays, repeat.
+// Each stage is a tight parallel loop over a compacted queue, which keeps caches warm.
+class WavefrontRenderer {
+public:
+    Trace& trace;
+    int batchSize = 1 << 20; // Paths in flight.
+    bool sortRays = false; // Sort bounce rays by origin and direction before tracing them.
+    bool groupByMaterial = true; // Shade the hits of each material together, in table order.
+    bool countTraversal = false; // Count BVH node visits and simulated cache misses of extend.
+    long long nodeVisits = 0, cacheMisses = 0;
+
+    // Path state, structure of arrays.
+    std::vector<float> rayOx, rayOy, rayOz, rayDx, rayDy, rayDz;
+    std::vector<float> rayConeWidth, rayConeAngle;
+    std::vector<float> throughputR, throughputG, throughputB;
+    std::vector<float> radianceR, radianceG, radianceB;
+    std::vector<int> pathDepth;
+    std::vector<int> pathPixel;
+    std::vector<Hit> hits;
+
+    // Queues of path indices.
+    std::vector<int> activeQueue, nextQueue;
+    std::vector<int> diffuseQueue, specularQueue, emissiveQueue;
+    std::vector<std::pair<uint32_t, int>> sortKeys;
+    std::vector<int> blockStarts, groupedQueue;
+    std::vector<char> pathKinds;
+
+    // Shadow rays, queued by the diffuse stage. Those of diffuseQueue[q] are
+    // shadowQueue[shadowOffsets[q] .. shadowOffsets[q + 1]).
+    struct ShadowRay {
+        glm::vec3 contribution;
+        glm::vec3 target;
+    };
+    std::vector<ShadowRay> shadowQueue;
+    std::vector<size_t> shadowOffsets, scanOffsets, blockSums;
+
+    WavefrontRenderer(Trace& ptrace) : trace(ptrace) {}
+
+    void render(std::vector<glm::vec4>& image){
+        trace.rendering = false;
+        unsigned int startTicks = SDL_GetTicks();
+
+        long long pixelCount = (long long)trace.width * trace.height;
+        long long totalPaths = pixelCount * trace.samples;
+        std::vector<glm::vec3> sum(pixelCount, glm::vec3(0, 0, 0));
+        nodeVisits = cacheMisses = 0;
+
+        for( long long waveStart = 0; waveStart < totalPaths; waveStart += batchSize ) {
+            std::cout << (float)waveStart / totalPaths * 100.0 << "                \r";
+            int count = (int)std::min<long long>(batchSize, totalPaths - waveStart);
+            generate(waveStart, count);
+
+            for( int bounce = 0; !activeQueue.empty(); ++bounce ){
+                // Camera rays are coherent already.
+                if( sortRays && bounce > 0 ) sortActive();
+                extend();
+                sortByMaterial();
+                shadeEmissive();
+                shadeSpecular();
+                shadeDiffuse();
+                traceShadowRays();
+                activeQueue.swap(nextQueue);
+            }
+
+            // Accumulate by pixel, the samples of a pixel are next to each other. A pixel split between two
+            // waves gets the part of each wave in turn.
+            long long firstPixel = waveStart / trace.samples, lastPixel = (waveStart + count - 1) / trace.samples;
+#pragma omp parallel for
+            for( long long pixel = firstPixel; pixel <= lastPixel; ++pixel ) {
+                int begin = (int)std::max<long long>(0, pixel * trace.samples - waveStart);
+                int end = (int)std::min<long long>(count, (pixel + 1) * trace.samples - waveStart);
+                for( int i = begin; i < end; ++i )
+                    sum[pixel] += glm::vec3(radianceR[i], radianceG[i], radianceB[i]);
+            }
+        }
+
+#pragma omp parallel for
+        for( long long i = 0; i < pixelCount; ++i ) {
+            glm::vec3 color = sum[i] / (float)trace.samples;
+            image[i] = glm::vec4(color.x, color.y, color.z, 1.0f);
+        }
+
+        unsigned int endTicks = SDL_GetTicks();
+        trace.renderTime = (endTicks - startTicks) / 1000.0;
+        std::cout << "100                \r";
+        if( countTraversal )
+            std::cout << "Node visits: " << nodeVisits << " cache misses: " << cacheMisses << std::endl;
+    }
+
+private:
+    void resize(int count){
+        if( rayOx.size() >= count ) return;
+        for( auto v : {&rayOx, &rayOy, &rayOz, &rayDx, &rayDy, &rayDz, &rayConeWidth, &rayConeAngle, &throughputR, &throughputG, &throughputB,
+                       &radianceR, &radianceG, &radianceB} )
+            v->resize(count);
+        pathDepth.resize(count);
+        pathPixel.resize(count);
+        hits.resize(count);
+    }
+
+    Ray getRay(int i) const {
+        Ray ray(glm::vec3(rayOx[i], rayOy[i], rayOz[i]), glm::vec3(rayDx[i], rayDy[i], rayDz[i]));
+        ray.coneWidth = rayConeWidth[i];
+        ray.coneAngle = rayConeAngle[i];
+        return ray;
+    }
+
+    void setRay(int i, const Ray& ray){
+        rayOx[i] = ray.start.x; rayOy[i] = ray.start.y; rayOz[i] = ray.start.z;
+        rayDx[i] = ray.dir.x; rayDy[i] = ray.dir.y; rayDz[i] = ray.dir.z;
+        rayConeWidth[i] = ray.coneWidth; rayConeAngle[i] = ray.coneAngle;
+    }
+
+    glm::vec3 throughput(int i) const { return glm::vec3(throughputR[i], throughputG[i], throughputB[i]); }
+
+    void setThroughput(int i, const glm::vec3& t){ throughputR[i] = t.x; throughputG[i] = t.y; throughputB[i] = t.z; }
+
+    void addRadiance(int i, const glm::vec3& r){ radianceR[i] += r.x; radianceG[i] += r.y; radianceB[i] += r.z; }
+
+    // Camera rays for paths [waveStart, waveStart + count).
+    void generate(long long waveStart, int count){
+        resize(count);
+        activeQueue.resize(count);
+#pragma omp parallel for
+        for( int i = 0; i < count; ++i ) {
+            int pixel = (waveStart + i) / trace.samples;
+            int x = pixel % trace.width;
+            int y = pixel / trace.width;
+            setRay(i, trace.camera.getRay(float(x) + randomFloat(), float(y) + randomFloat()));
+            setThroughput(i, glm::vec3(1, 1, 1));
+            radianceR[i] = radianceG[i] = radianceB[i] = 0;
+            pathDepth[i] = 1;
+            pathPixel[i] = pixel;
+            activeQueue[i] = i;
+        }
+    }
+
+    // Sort key of a ray: direction octant in the high bits, then the origin cell in Morton order.
+    // Rays next to each other in the queue then start close and go the same way, and visit mostly the same nodes.
+    uint32_t rayKey(int i, const AABB& sceneBox) const {
+        glm::vec3 extent = sceneBox.maximum - sceneBox.minimum;
+        float o[3] = { rayOx[i], rayOy[i], rayOz[i] };
+        uint32_t cell[3];
+        for( int a = 0; a < 3; ++a ) {
+            float f = extent[a] > 0 ? (o[a] - sceneBox.minimum[a]) / extent[a] : 0;
+            cell[a] = (uint32_t)glm::clamp(f * 1024.0f, 0.0f, 1023.0f); // 10 bits per axis.
+        }
+        uint32_t morton = 0;
+        for( int b = 0; b < 9; ++b ) // Top 9 bits of each axis, 27 bits.
+            for( int a = 0; a < 3; ++a )
+                morton |= ((cell[a] >> (b + 1)) & 1u) << (3 * b + a);
+        uint32_t octant = (rayDx[i] < 0) | (rayDy[i] < 0) << 1 | (rayDz[i] < 0) << 2;
+        return octant << 27 | morton;
+    }
+
+    void sortActive(){
+        AABB sceneBox;
+        trace.bvh.getAABB(sceneBox);
+        int n = activeQueue.size();
+        sortKeys.resize(n);
+#pragma omp parallel for
+        for( int q = 0; q < n; ++q )
+            sortKeys[q] = {rayKey(activeQueue[q], sceneBox), activeQueue[q]};
+        std::sort(sortKeys.begin(), sortKeys.end());
+        for( int q = 0; q < n; ++q ) activeQueue[q] = sortKeys[q].second;
+    }
+
+    void extend(){
+        int n = activeQueue.size();
+#pragma omp parallel
+        {
+            // Each thread counts with its own simulated cache.
+            TraversalStats stats;
+            if( countTraversal ) traversalStats = &stats;
+#pragma omp for schedule(dynamic, 256)
+            for( int q = 0; q < n; ++q ) {
+                int i = activeQueue[q];
+                hits[i] = trace.firstIntersect(getRay(i));
+            }
+            traversalStats = nullptr;
+#pragma omp critical
+            {
+                nodeVisits += stats.nodeVisits;
+                cacheMisses += stats.cacheMisses;
+            }
+        }
+    }
+
+    // Misses are finished here, everything else goes to the queue of its material type.
+    void sortByMaterial(){
+        enum { MISSED, TO_EMISSIVE, TO_SPECULAR, TO_DIFFUSE }; // Queue of a path.
+        int n = activeQueue.size();
+        pathKinds.resize(n);
+#pragma omp parallel for
+        for( int q = 0; q < n; ++q ) {
+            int i = activeQueue[q];
+            const Hit& hit = hits[i];
+            if( !hit.valid ){
+                addRadiance(i, throughput(i) * trace.backgroundColor(getRay(i)));
+                pathKinds[q] = MISSED;
+                continue;
+            }
+            const Material& material = materialTable[hit.material];
+            pathKinds[q] = material.emissive() ? TO_EMISSIVE : material.noPdf() ? TO_SPECULAR : TO_DIFFUSE;
+        }
+
+        emissiveQueue.clear();
+        specularQueue.clear();
+        diffuseQueue.clear();
+        nextQueue.clear();
+        appendIf(activeQueue, [&](int q){ return pathKinds[q] == TO_EMISSIVE; }, emissiveQueue);
+        appendIf(activeQueue, [&](int q){ return pathKinds[q] == TO_SPECULAR; }, specularQueue);
+        appendIf(activeQueue, [&](int q){ return pathKinds[q] == TO_DIFFUSE; }, diffuseQueue);
+
+        if( groupByMaterial ){
+            groupQueue(specularQueue);
+            groupQueue(diffuseQueue);
+        }
+    }
+
+    static const int scanBlock = 1 << 14; // Queue entries per block of the parallel scans.
+
+    // Exclusive prefix sum of count(0 .. n - 1) into offsets, with the total at offsets[n]. The blocks are
+    // summed in parallel, a scan over the block sums gives where each block starts, then each block
+    // writes its offsets in parallel.
+    template<typename F>
+    void exclusiveScan(int n, F count, std::vector<size_t>& offsets){
+        int blocks = (n + scanBlock - 1) / scanBlock;
+        blockSums.assign(blocks + 1, 0);
+#pragma omp parallel for
+        for( int b = 0; b < blocks; ++b ) {
+            size_t total = 0;
+            for( int k = b * scanBlock; k < std::min(n, (b + 1) * scanBlock); ++k ) total += count(k);
+            blockSums[b + 1] = total;
+        }
+        for( int b = 0; b < blocks; ++b ) blockSums[b + 1] += blockSums[b];
+
+        offsets.resize(n + 1);
+#pragma omp parallel for
+        for( int b = 0; b < blocks; ++b ) {
+            size_t offset = blockSums[b];
+            for( int k = b * scanBlock; k < std::min(n, (b + 1) * scanBlock); ++k ) {
+                offsets[k] = offset;
+                offset += count(k);
+            }
+        }
+        offsets[n] = blockSums[blocks];
+    }
+
+    // Appends queue[q] for each q where keep(q), in order, to out.
+    template<typename F>
+    void appendIf(const std::vector<int>& queue, F keep, std::vector<int>& out){
+        int n = queue.size();
+        exclusiveScan(n, [&](int q){ return keep(q) ? 1 : 0; }, scanOffsets);
+        size_t base = out.size();
+        out.resize(base + scanOffsets[n]);
+#pragma omp parallel for
+        for( int q = 0; q < n; ++q )
+            if( scanOffsets[q + 1] != scanOffsets[q] ) out[base + scanOffsets[q]] = queue[q];
+    }
+
+    // Counting sort of a queue by material index, keeping the order within a material. Each block counts
+    // its materials in parallel. Then the blocks get where their entries of each material start, the
+    // materials in table order and the blocks in queue order within each material. Then each block
+    // places its entries in parallel.
+    void groupQueue(std::vector<int>& queue){
+        int n = queue.size(), materials = materialTable.size();
+        int blocks = (n + scanBlock - 1) / scanBlock;
+        blockStarts.assign((size_t)blocks * materials, 0);
+#pragma omp parallel for
+        for( int b = 0; b < blocks; ++b )
+            for( int k = b * scanBlock; k < std::min(n, (b + 1) * scanBlock); ++k )
+                blockStarts[(size_t)b * materials + hits[queue[k]].material]++;
+
+        int start = 0;
+        for( int m = 0; m < materials; ++m )
+            for( int b = 0; b < blocks; ++b ) {
+                int count = blockStarts[(size_t)b * materials + m];
+                blockStarts[(size_t)b * materials + m] = start;
+                start += count;
+            }
+
+        groupedQueue.resize(n);
+#pragma omp parallel for
+        for( int b = 0; b < blocks; ++b )
+            for( int k = b * scanBlock; k < std::min(n, (b + 1) * scanBlock); ++k )
+                groupedQueue[blockStarts[(size_t)b * materials + hits[queue[k]].material]++] = queue[k];
+        queue.swap(groupedQueue);
+    }
+
+    void shadeEmissive(){
+        int n = emissiveQueue.size();
+#pragma omp parallel for
+        for( int q = 0; q < n; ++q ) {
+            int i = emissiveQueue[q];
+            addRadiance(i, throughput(i) * materialTable[hits[i].material].emit(hits[i]));
+        }
+    }
+
+    // Mirrors and glass: follow the scattered ray.
+    void shadeSpecular(){
+        int n = specularQueue.size();
+        std::vector<char> alive(n, 0);
+#pragma omp parallel for
+        for( int q = 0; q < n; ++q ) {
+            int i = specularQueue[q];
+            const Hit& hit = hits[i];
+            glm::vec3 attenuation(0, 0, 0);
+            float pdf = 1.0;
+            Ray ray = getRay(i);
+            Ray newRay = materialTable[hit.material].scatter(ray, hit, attenuation, pdf);
+            if( attenuation.x < 0 || pathDepth[i] + 1 > trace.maxDepth ) continue;
+
+            trace.continueCone(ray, hit, newRay);
+            setRay(i, newRay);
+            setThroughput(i, throughput(i) * attenuation);
+            pathDepth[i]++;
+            alive[q] = 1;
+        }
+        appendIf(specularQueue, [&](int q){ return alive[q]; }, nextQueue);
+    }
+
+    // Queue shadow rays to point lights, then sample the next direction. Each hit gets the slots of
+    // its own shadow rays, by a scan over their counts.
+    void shadeDiffuse(){
+        int n = diffuseQueue.size();
+        exclusiveScan(n, [&](int q){ return trace.pointLightSampleCount(hits[diffuseQueue[q]]); }, shadowOffsets);
+        shadowQueue.resize(shadowOffsets[n]);
+        std::vector<char> alive(n, 0);
+
+#pragma omp parallel for
+        for( int q = 0; q < n; ++q ) {
+            int i = diffuseQueue[q];
+            const Hit& hit = hits[i];
+            glm::vec3 pathThroughput = throughput(i);
+
+            size_t s = shadowOffsets[q];
+            trace.forEachPointLightSample(hit, [&](const Light& light, float weight){
+                ShadowRay& shadowRay = shadowQueue[s++];
+                shadowRay.contribution = pathThroughput * trace.unshadowedPointLight(hit, light) * weight;
+                shadowRay.target = light.position;
+            });
+
+            if( pathDepth[i] + 1 > trace.maxDepth ) continue;
+
+            Ray ray = getRay(i);
+            glm::vec3 attenuation(0, 0, 0);
+            float pdf = 1.0;
+            Ray newRay = materialTable[hit.material].scatter(ray, hit, attenuation, pdf);
+            if( !trace.sampleDiffuse(hit, newRay, pdf) ) continue;
+
+            trace.continueCone(ray, hit, newRay);
+            setRay(i, newRay);
+            setThroughput(i, pathThroughput * attenuation * materialTable[hit.material].pdf(ray, hit, newRay) / pdf);
+            pathDepth[i]++;
+            alive[q] = 1;
+        }
+        appendIf(diffuseQueue, [&](int q){ return alive[q]; }, nextQueue);
+    }
+
+    // The shadow rays of a path are next to each other in the queue, each thread adds up the visible
+    // ones of its paths.
+    void traceShadowRays(){
+        int n = diffuseQueue.size();
+#pragma omp parallel for schedule(dynamic, 256)
+        for( int q = 0; q < n; ++q ) {
+            int i = diffuseQueue[q];
+            glm::vec3 light(0, 0, 0);
+            for( size_t s = shadowOffsets[q]; s < shadowOffsets[q + 1]; ++s )
+                if( !trace.shadowIntersect(hits[i], shadowQueue[s].target) ) light += shadowQueue[s].contribution;
+            addRadiance(i, light);
+        }
+    }
+};
@@ -6,6 +6,11 @@
 #include "Program.h"
 #include "TexturedQuad.h"
 #include "Trace.h"
+#include "Wavefront.h"
+#include "PhotonMapper.h"
+#include "Metropolis.h"
+#include "Reservoir.h"
+#include "Preview.h"
 
 #include "imgui/imgui.h"
 #include "imgui/imgui_impl_sdl.h"
@@ -27,8 +32,96 @@ GLuint windowHeight = 900;
 
 double t = 0;
 
+// Settings from the command line.
+struct Options {
+    std::string scene;
+    int mode = -1;
+    int samples = 0;
+    float aoDistance = 0, depthRange = 0;
+    int aoSamples = 0;
+    bool packets = true;
+    std::string output; // Render once to this png and quit, without a window.
+};
+
+const char* usage = "Usage: tracer [--scene name] [--mode 0-8|path|direct|sppm|mlt|restir|ao|normals|depth|id] [--samples n]\n"
+                    "              [--size w h] [--ao-distance d] [--ao-samples n] [--depth-range d] [--no-packets] [--output file.png]\n";
+
+bool parseOptions(int argc, char** argv, Options& options){
+    const char* modeNames[MODE_COUNT] = { "path", "direct", "sppm", "mlt", "restir", "ao", "normals", "depth", "id" };
+    for( int i = 1; i < argc; ++i ) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if( arg == "--scene" && hasValue ) options.scene = argv[++i];
+        else if( arg == "--mode" && hasValue ){
+            std::string mode = argv[++i];
+            for( int m = 0; m < MODE_COUNT; ++m )
+                if( mode == modeNames[m] || mode == std::to_string(m) ) options.mode = m;
+            if( options.mode < 0 ) return false;
+        }
+        else if( arg == "--samples" && hasValue ) options.samples = atoi(argv[++i]);
+        else if( arg == "--size" && i + 2 < argc ){
+            windowWidth = atoi(argv[++i]);
+            windowHeight = atoi(argv[++i]);
+        }
+        else if( arg == "--ao-distance" && hasValue ) options.aoDistance = atof(argv[++i]);
+        else if( arg == "--ao-samples" && hasValue ) options.aoSamples = atoi(argv[++i]);
+        else if( arg == "--depth-range" && hasValue ) options.depthRange = atof(argv[++i]);
+        else if( arg == "--no-packets" ) options.packets = false;
+        else if( arg == "--output" && hasValue ) options.output = argv[++i];
+        else return false;
+    }
+    return windowWidth > 0 && windowHeight > 0;
+}
+
+bool applyOptions(const Options& options, Trace& trace){
+    if( !options.scene.empty() && !trace.initFunctions.count(options.scene) ){
+        std::cout << "Unknown scene " << options.scene << std::endl;
+        return false;
+    }
+    if( !options.scene.empty() ) trace.loadScene(options.scene);
+    if( options.mode >= 0 ) trace.traceFunctionType = options.mode;
+    if( options.samples > 0 ) trace.samples = options.samples;
+    if( options.aoDistance > 0 ) trace.aoDistance = options.aoDistance;
+    if( options.aoSamples > 0 ) trace.aoSamples = options.aoSamples;
+    if( options.depthRange > 0 ) trace.depthRange = options.depthRange;
+    trace.packetTracing = options.packets;
+    return true;
+}
+
+// Gamma corrected like the display shader. The image starts with the bottom row.
+void writePng(const std::string& fileName, const std::vector<glm::vec4>& image, int width, int height, float gamma){
+    std::vector<unsigned char> data(3 * width * height);
+    for( int i = 0; i < width * height; ++i )
+        for( int c = 0; c < 3; ++c )
+            data[3 * i + c] = (unsigned char)(255 * pow(glm::clamp(image[i][c], 0.0f, 1.0f), 1.0f / gamma) + 0.5f);
+    stbi_flip_vertically_on_write(1);
+    if( !stbi_write_png(fileName.c_str(), width, height, 3, data.data(), 3 * width) )
+        std::cout << "Couldn't write " << fileName << std::endl;
+}
+
 
 int main(int argv, char** args) {
+    Options options;
+    if( !parseOptions(argv, args, options) ){ std::cout << usage; return -1; }
+
+    // Render once without a window.
+    if( !options.output.empty() ){
+        if( SDL_Init(SDL_INIT_TIMER) != 0 ){ std::cout << "Couldn't initialize SDL!"; return -1; }
+        Trace trace;
+        trace.width = windowWidth; trace.height = windowHeight;
+        trace.initScene();
+        if( !applyOptions(options, trace) ) return -1;
+        std::vector<glm::vec4> image(windowWidth * windowHeight);
+        if( trace.traceFunctionType == MODE_SPPM ) PhotonMapper(trace).render( image );
+        else if( trace.traceFunctionType == MODE_MLT ) MetropolisRenderer(trace).render( image );
+        else if( trace.traceFunctionType == MODE_RESTIR ) ReservoirRenderer(trace).render( image );
+        else trace.render( image );
+        std::cout << "Render Time: " << trace.renderTime << std::endl;
+        writePng(options.output, image, windowWidth, windowHeight, 2.0);
+        SDL_Quit();
+        return EXIT_SUCCESS;
+    }
+
     // === SDL and OpenGl (GLEW) setup. ===
     if( SDL_Init(SDL_INIT_TIMER | SDL_INIT_VIDEO ) != 0 ){ std::cout << "Couldn't initialize SDL!"; return -1; }
     SDL_Window *window = SDL_CreateWindow("Path Tracing", 20, 40, windowWidth, windowHeight, SDL_WINDOW_OPENGL | SDL_WINDOW_ALLOW_HIGHDPI | SDL_WINDOW_RESIZABLE  );
@@ -56,6 +149,13 @@ int main(int argv, char** args) {
     Trace trace;
     trace.width = windowWidth; trace.height = windowHeight;
     trace.initScene();
+    applyOptions(options, trace);
+    WavefrontRenderer wavefront(trace);
+    bool useWavefront = false;
+    PhotonMapper photonMapper(trace);
+    MetropolisRenderer metropolis(trace);
+    ReservoirRenderer reservoirs(trace);
+    PreviewRenderer preview(trace);
     
     std::vector<glm::vec4> image(windowWidth * windowHeight); // Image for rendering in one go.
     std::vector<glm::vec4> blackPixels(windowWidth * windowHeight); // Black pixels to clear texture.
@@ -76,6 +176,10 @@ int main(int argv, char** args) {
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
 
+    // What the windows edit, taken in by the trace before each frame's rendering.
+    SceneSettings edits = trace.settings();
+    std::string nextScene; // Chosen in the Init Scene window, built before the next frame.
+
     bool running = true;
     while (running) {
         unsigned int ticks = SDL_GetTicks();
@@ -101,7 +205,18 @@ int main(int argv, char** args) {
         // ====== Render image ======
         glClear(GL_COLOR_BUFFER_BIT);
 
+        // No rays are in flight here, the renderers start their frame with the new version.
+        if( !nextScene.empty() ){
+            trace.loadScene(nextScene);
+            nextScene.clear();
+            edits = trace.settings();
+        }
+        else trace.applySettings(edits);
+
         trace.renderLoop(quad.texture);
+        photonMapper.renderLoop(quad.texture);
+        reservoirs.renderLoop(quad.texture);
+        preview.renderLoop(quad.texture);
         program.setUniform(quad.texture, "texture1");
         quad.draw();
 
@@ -116,20 +231,38 @@ int main(int argv, char** args) {
 
         if (ImGui::Button("Stop")){
             trace.rendering = false;
+            photonMapper.rendering = false;
+            reservoirs.rendering = false;
+            preview.rendering = false;
         }
 
 
         if (ImGui::Button("Render")){
             std::cout << "Started Rendering!" << std::endl;
-            trace.render( image );
+            preview.rendering = false;
+            if( trace.traceFunctionType == MODE_SPPM ) photonMapper.render( image );
+            else if( trace.traceFunctionType == MODE_MLT ) metropolis.render( image );
+            else if( trace.traceFunctionType == MODE_RESTIR ) reservoirs.render( image );
+            else if( useWavefront && trace.traceFunctionType == MODE_PATH ) wavefront.render( image );
+            else trace.render( image );
             quad.setTexture( windowWidth, windowHeight, image );
             std::cout << "Render Time: " << trace.renderTime << std::endl;
         }
 
         if (ImGui::Button("Render Loop")){
             std::cout << "Render Loop started!" << std::endl;
+            preview.rendering = false;
             quad.setTexture( windowWidth, windowHeight, blackPixels );
-            trace.startRenderLoop();
+            if( trace.traceFunctionType == MODE_SPPM ) photonMapper.startRenderLoop();
+            else if( trace.traceFunctionType == MODE_MLT ){
+                // Not progressive, the chains splat all over the image.
+                metropolis.render( image );
+                quad.setTexture( windowWidth, windowHeight, image );
+            }
+            else if( trace.traceFunctionType == MODE_RESTIR ) reservoirs.startRenderLoop();
+            // Direct lighting is fast enough to show every frame, until stopped.
+            else if( trace.traceFunctionType == MODE_DIRECT ) preview.startRenderLoop();
+            else trace.startRenderLoop();
         }
 
         ImGui::DragFloat("gamma correction", &gamma, 0.01, 0.01, 10.0);
@@ -140,7 +273,7 @@ int main(int argv, char** args) {
         ImGui::Text( ("Render t: " + to_string( trace.renderTime )).c_str()  );
 
         // === Remaining Time ===
-        float percent = float(trace.ry) / trace.height;
+        float percent = (trace.passes + float(trace.ry) / trace.height) / trace.samples;
         float remainingTime = (1 - percent) / percent * trace.renderTime;
         percent *= 100;
         ImGui::Text( ("Percent Complete: " + to_string( percent )).c_str()  );
@@ -148,44 +281,134 @@ int main(int argv, char** args) {
 
 
         ImGui::DragInt("samples", &trace.samples, 0.5f, 1, 1000000);
-
-        ImGui::SliderInt("Tracefunc", &trace.traceFunctionType, 0, 1);
-        if( trace.traceFunctionType == 0 ) {
+        ImGui::SliderFloat("FrameBudget ms", &trace.frameBudget, 1, 200);
+        ImGui::SliderFloat("SettleTime", &trace.settleTime, 0, 2);
+        ImGui::Checkbox("Reprojection", &trace.reprojection);
+        if( trace.reprojection ) ImGui::DragFloat("ReprojectionHistory", &trace.reprojectionHistory, 0.1, 1, 1024);
+
+        ImGui::SliderInt("Tracefunc", &trace.traceFunctionType, 0, MODE_COUNT - 1);
+        if( trace.startsFromCameraHit() ) {
+            ImGui::Checkbox("Packets", &trace.packetTracing);
+            ImGui::Checkbox("HitCache", &trace.hitCaching);
+            if( trace.hitCaching ) ImGui::SliderInt("HitCacheJitters", &trace.hitCache.jitters, 1, 64);
+        }
+        if( trace.traceFunctionType == MODE_PATH ) {
             ImGui::SliderInt("MaxDepth", &trace.maxDepth, 1, 50);
+            ImGui::Checkbox("Wavefront", &useWavefront);
+            if( useWavefront ) {
+                ImGui::Checkbox("SortRays", &wavefront.sortRays);
+                ImGui::Checkbox("CountCacheMisses", &wavefront.countTraversal);
+                if( wavefront.countTraversal && wavefront.nodeVisits > 0 )
+                    ImGui::Text( ("Node misses: " + to_string( wavefront.cacheMisses ) + " / " + to_string( wavefront.nodeVisits )).c_str() );
+            }
+            ImGui::SliderInt("IrradianceCache", &trace.irradianceCaching, 0, 2);
+            if( trace.irradianceCaching > 0 ) {
+                ImGui::SliderFloat("CacheAccuracy", &trace.irradianceCache.accuracy, 0.05, 1);
+                ImGui::Text( ("Cache records: " + to_string( trace.irradianceCache.size() )).c_str() );
+            }
+            ImGui::Checkbox("AnalyticLights", &trace.analyticLighting);
+            if( trace.analyticLighting )
+                ImGui::DragInt("ShadowRays", &trace.analyticShadowRays, 0.1f, 1, 64);
+            ImGui::Checkbox("PathGuiding", &trace.pathGuiding);
+            if( trace.pathGuiding ) {
+                ImGui::DragInt("GuidingPasses", &trace.guidingPasses, 0.1f, 1, 1024);
+                ImGui::Text( ("Guide regions: " + to_string( trace.pathGuide.leaves() )).c_str() );
+            }
+            ImGui::SliderInt("LightSelection", &trace.lightSelectionType, 0, 2);
+            if( trace.lightSelectionType == 2 )
+                ImGui::DragInt("LightSamples", &trace.lightSamples, 0.1f, 1, 64);
+            ImGui::Checkbox("PathReplay", &trace.pathReplay);
+            if( trace.pathReplay ) {
+                ImGui::SliderInt("ReplaySamples", &trace.replaySamples, 1, 16);
+                ImGui::Text( ("Recorded paths: " + to_string( trace.pathRecords.memory() >> 20 ) + " MB").c_str() );
+            }
+        }
+        if( trace.traceFunctionType == MODE_DIRECT ) {
+            ImGui::Checkbox("DynamicResolution", &preview.dynamicResolution);
+            if( preview.dynamicResolution ) ImGui::SliderFloat("TargetFps", &preview.targetFps, 5, 120);
+            else ImGui::SliderFloat("Resolution", &preview.scale, preview.minScale, 1);
+            if( preview.rendering )
+                ImGui::Text( ("Preview: " + to_string( preview.internalWidth ) + " x " + to_string( preview.internalHeight )
+                              + ", " + to_string( preview.frameTime * 1000 ) + " ms").c_str() );
+        }
+        if( trace.traceFunctionType == MODE_SPPM ) {
+            ImGui::SliderInt("MaxDepth", &trace.maxDepth, 1, 50);
+            ImGui::DragInt("PhotonsPerPass", &photonMapper.photonsPerPass, 1000, 0, 1 << 26);
+            ImGui::DragFloat("InitialRadius", &photonMapper.initialRadius, 0.1, 0.1, 100);
+            ImGui::SliderFloat("Alpha", &photonMapper.alpha, 0.01, 1);
+            ImGui::Text( ("Passes: " + to_string( photonMapper.passes )).c_str() );
+        }
+        if( trace.traceFunctionType == MODE_MLT ) {
+            ImGui::SliderInt("MaxDepth", &trace.maxDepth, 1, 50);
+            ImGui::DragInt("Chains", &metropolis.chains, 1, 1, 1 << 20);
+            ImGui::DragInt("BootstrapSamples", &metropolis.bootstrapSamples, 100, 1, 1 << 24);
+            ImGui::SliderFloat("MutationSize", &metropolis.sigma, 0.001, 0.1);
+            ImGui::SliderFloat("LargeStepProbability", &metropolis.largeStepProbability, 0, 1);
+            ImGui::Text( ("Acceptance: " + to_string( metropolis.acceptance )).c_str() );
+        }
+        if( trace.traceFunctionType == MODE_RESTIR ) {
+            ImGui::DragInt("Candidates", &reservoirs.candidates, 0.2f, 1, 1024);
+            ImGui::Checkbox("VisibilityReuse", &reservoirs.visibilityReuse);
+            ImGui::Checkbox("TemporalReuse", &reservoirs.temporalReuse);
+            ImGui::Checkbox("SpatialReuse", &reservoirs.spatialReuse);
+            if( reservoirs.spatialReuse ) {
+                ImGui::SliderInt("Neighbours", &reservoirs.spatialNeighbours, 1, 32);
+                ImGui::SliderFloat("SpatialRadius", &reservoirs.spatialRadius, 1, 100);
+            }
+            ImGui::Text( ("Passes: " + to_string( reservoirs.passes )).c_str() );
+        }
+        if( trace.traceFunctionType == MODE_AO || trace.showsGeometry() ) {
+            ImGui::Text( (std::string("Showing: ") + (trace.traceFunctionType == MODE_AO ? "ambient occlusion" : trace.traceFunctionType == MODE_NORMALS ? "normals" :
+                                                     trace.traceFunctionType == MODE_DEPTH ? "depth" : "object ids")).c_str() );
+            if( trace.traceFunctionType == MODE_AO ) {
+                ImGui::DragFloat("AODistance", &trace.aoDistance, 0.01, 0.001, 100);
+                ImGui::DragInt("AOSamples", &trace.aoSamples, 0.1f, 1, 256);
+            }
+            if( trace.traceFunctionType == MODE_DEPTH )
+                ImGui::DragFloat("DepthRange", &trace.depthRange, 0.01, 0.01, 1000);
         }
 
         float adjustStep = 0.01;
         ImGui::Text( "Camera" );
-        ImGui::DragFloat3("pos", reinterpret_cast<float *>(&trace.camera.eye), adjustStep);
-        ImGui::DragFloat3("lookat", reinterpret_cast<float *>(&trace.camera.lookat), adjustStep);
-        ImGui::DragFloat("fov", &trace.camera.fov, adjustStep, 0.01, 3.12);
-        ImGui::DragFloat("aperture", &trace.camera.aperture, 0.005, 0.0, 100.0);
-        trace.camera.set();
+        ImGui::DragFloat3("pos", reinterpret_cast<float *>(&edits.eye), adjustStep);
+        ImGui::DragFloat3("lookat", reinterpret_cast<float *>(&edits.lookat), adjustStep);
+        ImGui::DragFloat("fov", &edits.fov, adjustStep, 0.01, 3.12);
+        ImGui::DragFloat("aperture", &edits.aperture, 0.005, 0.0, 100.0);
 
         ImGui::Text("Background Color");
-        ImGui::DragFloat3("color1", reinterpret_cast<float *>(&trace.backGroundColor1), 0.001, 0, 1);
-        ImGui::DragFloat3("color2", reinterpret_cast<float *>(&trace.backGroundColor2), 0.001, 0, 1);
+        ImGui::DragFloat3("color1", reinterpret_cast<float *>(&edits.backGroundColor1), 0.001, 0, 1);
+        ImGui::DragFloat3("color2", reinterpret_cast<float *>(&edits.backGroundColor2), 0.001, 0, 1);
 
         ImGui::Text( "Direct Lights" );
-        for( int i = 0; i < trace.lights.size(); ++i) {
+        if( trace.environment.loaded() )
+            ImGui::DragFloat("environment", &edits.environmentIntensity, 0.01, 0, 100);
+        for( int i = 0; i < edits.lights.size(); ++i) {
             ImGui::DragFloat3(("pos" + std::to_string(i)).c_str(),
-                              reinterpret_cast<float *>(&trace.lights[i].position), adjustStep);
+                              reinterpret_cast<float *>(&edits.lights[i].position), adjustStep);
             ImGui::DragFloat3(("power" + std::to_string(i)).c_str(),
-                              reinterpret_cast<float *>(&trace.lights[i].power), adjustStep);
+                              reinterpret_cast<float *>(&edits.lights[i].power), adjustStep);
         }
 
         ImGui::End();
 
         ImGui::Begin("Materials");
 
-        for( const auto& it : trace.materials ){
-            if(it.second->transparent()){
-                ImGui::DragFloat(it.first.c_str(), &reinterpret_cast<TransparentMaterial*>(it.second)->refIndex, 0.001 );
-            }else {
-                ImGui::DragFloat3(it.first.c_str(), reinterpret_cast<float *>(&it.second->albedo), 0.001, 0, 1);
-            }
+        for( int i = 0; i < edits.materials.size(); ++i ){
+            Material& material = edits.materials[i];
+            const char* name = materialTable.names[i].c_str();
+            if( material.transparent() ) ImGui::DragFloat(name, &material.refIndex, 0.001 );
+            else ImGui::DragFloat3(name, reinterpret_cast<float *>(&material.albedo), 0.001, 0, 1);
         }
 
+        ImGui::Text( "Texture cache" );
+        int budgetMB = textureCache.memoryBudget >> 20;
+        if( ImGui::DragInt("budget MB", &budgetMB, 1, 1, 16384) ){
+            textureCache.memoryBudget = (size_t)budgetMB << 20;
+            textureCache.trim();
+        }
+        ImGui::Text( ("Used: " + to_string( textureCache.memoryUsed >> 20 ) + " MB, loads: " + to_string( textureCache.tileLoads ) +
+                      ", evictions: " + to_string( textureCache.evictions )).c_str() );
+
         ImGui::End();
 
         ImGui::Begin("Screenshot");
@@ -206,11 +429,7 @@ int main(int argv, char** args) {
 
         ImGui::Begin("Init Scene");
         for( auto it : trace.initFunctions){
-            if(ImGui::Button(it.first.c_str())){
-                trace.resetScene();
-                (trace.*(it.second))();
-                trace.makeBVH();
-            }
+            if(ImGui::Button(it.first.c_str())) nextScene = it.first;
         }
         ImGui::End();
 